@@ -14,6 +14,9 @@
 #include <pcl/point_types.h>
 #include <pcl/point_cloud.h>
 
+// opencv
+#include <opencv2/opencv.hpp>
+
 // sensor_msg
 #include <sensor_msgs/PointCloud2.h>
 #include <sensor_msgs/point_cloud_conversion.h>
@@ -60,6 +63,91 @@ void loadPcd(string filepath, pcl::PointCloud<PointType> &cloud, const char* nam
     }
 }
 
+/** 64 bit FNV-1a, chain calls through hash to cover several buffers **/
+inline uint64_t fnv1a(const void *data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/** 21 bits per axis, covers +-10 km at 1 cm voxels **/
+inline uint64_t voxelKey(float x, float y, float z, float voxel_size) {
+    const int64_t kOffset = 1 << 20;
+    const uint64_t kMask = (1 << 21) - 1;
+    uint64_t ix = (int64_t)floor(x / voxel_size) + kOffset;
+    uint64_t iy = (int64_t)floor(y / voxel_size) + kOffset;
+    uint64_t iz = (int64_t)floor(z / voxel_size) + kOffset;
+    return ((ix & kMask) << 42) | ((iy & kMask) << 21) | (iz & kMask);
+}
+
+/** 1D squared euclidean distance transform of sampled function f (Felzenszwalb and Huttenlocher) **/
+/** v and z are scratch buffers of n and n + 1 elements **/
+inline void distanceTransform1D(const float *f, float *d, int n, int *v, float *z) {
+    const float kInf = 1e20f;
+    int k = 0;
+    v[0] = 0;
+    z[0] = -kInf;
+    z[1] = kInf;
+    for (int q = 1; q < n; ++q) {
+        float s = ((f[q] + (float)q * q) - (f[v[k]] + (float)v[k] * v[k])) / (2.0f * (q - v[k]));
+        while (s <= z[k]) {
+            --k;
+            s = ((f[q] + (float)q * q) - (f[v[k]] + (float)v[k] * v[k])) / (2.0f * (q - v[k]));
+        }
+        ++k;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = kInf;
+    }
+    k = 0;
+    for (int q = 0; q < n; ++q) {
+        while (z[k + 1] < q) {
+            ++k;
+        }
+        d[q] = (float)(q - v[k]) * (q - v[k]) + f[v[k]];
+    }
+}
+
+/** runs filter on horizontal bands of src in parallel, each band is extended by halo rows **/
+/** on both sides and only its own rows are kept, so the filters see across the seams **/
+/** the padded bands start at multiples of align, filters working on an image pyramid with **/
+/** align = 2^(levels + 1) then sample the same phase as on the whole image **/
+template <typename Filter>
+void tiledFilter(const cv::Mat &src, cv::Mat &dst, int dst_type, int num_tiles, int halo, Filter filter, int align = 1) {
+    dst.create(src.rows, src.cols, dst_type);
+    cv::parallel_for_(cv::Range(0, num_tiles), [&](const cv::Range &range) {
+        for (int t = range.start; t < range.end; ++t) {
+            const int row_begin = src.rows * t / num_tiles;
+            const int row_end = src.rows * (t + 1) / num_tiles;
+            const int pad_begin = std::max(0, row_begin - halo) / align * align;
+            const int pad_end = std::min(src.rows, row_end + halo);
+            cv::Mat tile_src = src.rowRange(pad_begin, pad_end).clone();
+            cv::Mat tile_dst;
+            filter(tile_src, tile_dst);
+            tile_dst.rowRange(row_begin - pad_begin, row_end - pad_begin).copyTo(dst.rowRange(row_begin, row_end));
+        }
+    });
+}
+
+/** drops the short closed contours, len_threshold counts coordinates (2 per point) as in edge_extraction.py **/
+inline cv::Mat contourFilter(const cv::Mat &edge_img, int len_threshold) {
+    std::vector<std::vector<cv::Point>> contours, contours_out;
+    cv::findContours(edge_img, contours, cv::RETR_LIST, cv::CHAIN_APPROX_NONE);
+    for (const auto &contour : contours) {
+        const int dist = 2 * contour.size();
+        const int end_dist = std::abs(contour.front().x - contour.back().x) + std::abs(contour.front().y - contour.back().y);
+        if ((dist < len_threshold && 8 * end_dist < dist) || (dist < len_threshold / 8)) {
+            continue;
+        }
+        contours_out.push_back(contour);
+    }
+    cv::Mat edge_out = cv::Mat::zeros(edge_img.size(), CV_8U);
+    cv::drawContours(edge_out, contours_out, -1, 255, 1);
+    return edge_out;
+}
+
 Eigen::Matrix4f LoadTransMat(std::string trans_path){
     std::ifstream load_stream;
     load_stream.open(trans_path);
@@ -135,6 +223,67 @@ Eigen::Matrix<T, 2, 1> IntrinsicTransform(Eigen::Matrix<T, K_INT, 1> &intrinsic,
     return undistorted_projection;
 }
 
+/** projection of point under the quaternion [x, y, z, w] extrinsic and the intrinsic model of IntrinsicTransform, **/
+/** jacobian, if given, is w.r.t. [q(4), t(3), intrinsic(K_INT)], hand derived from the same expressions as **/
+/** Eigen's toRotationMatrix and IntrinsicTransform, so it matches their Jet derivatives **/
+inline Eigen::Matrix<double, 2, 1> projectionJacobian(const double *q, const double *t, const double *intrinsic,
+                                                      const Eigen::Matrix<double, 3, 1> &point,
+                                                      Eigen::Matrix<double, 2, 7 + K_INT> *jacobian) {
+    const double qx = q[0], qy = q[1], qz = q[2], qw = q[3];
+    const double a = point(0), b = point(1), c = point(2);
+    const Eigen::Matrix<double, 3, 3> R = Eigen::Quaterniond(qw, qx, qy, qz).toRotationMatrix();
+    const Eigen::Matrix<double, 3, 1> P = R * point + Eigen::Matrix<double, 3, 1>(t[0], t[1], t[2]);
+    const double X = P(0), Y = P(1), Z = P(2);
+    const double rho2 = X * X + Y * Y, rho = sqrt(rho2), n2 = rho2 + Z * Z;
+    const double theta = acos(Z / sqrt(n2));
+    const double uv_radius = intrinsic[2] + theta * (intrinsic[3] + theta * (intrinsic[4] + theta * (intrinsic[5] + theta * intrinsic[6])));
+    const double pu = uv_radius / rho * X + intrinsic[0];
+    const double pv = uv_radius / rho * Y + intrinsic[1];
+    /** affine [[c, d], [e, 1]] **/
+    const double aff_c = intrinsic[7], aff_d = intrinsic[8], aff_e = intrinsic[9];
+    const double det = aff_c - aff_e * aff_d;
+    const double U = (pu - aff_d * pv) / det, V = (-aff_e * pu + aff_c * pv) / det;
+    if (jacobian == nullptr) {
+        return {U, V};
+    }
+
+    Eigen::Matrix<double, 2, 2> affine_inv;
+    affine_inv << 1, -aff_d, -aff_e, aff_c;
+    affine_inv /= det;
+    /** d(pu, pv) / dP through theta and the unit direction (X, Y) / rho **/
+    const double d_radius = intrinsic[3] + theta * (2 * intrinsic[4] + theta * (3 * intrinsic[5] + theta * 4 * intrinsic[6]));
+    const double rho3 = rho * rho2;
+    const Eigen::Matrix<double, 3, 1> d_theta(Z * X / (rho * n2), Z * Y / (rho * n2), -rho / n2);
+    Eigen::Matrix<double, 2, 3> dp_dP;
+    dp_dP << d_radius * d_theta(0) * X / rho + uv_radius * Y * Y / rho3,
+             d_radius * d_theta(1) * X / rho - uv_radius * X * Y / rho3,
+             d_radius * d_theta(2) * X / rho,
+             d_radius * d_theta(0) * Y / rho - uv_radius * X * Y / rho3,
+             d_radius * d_theta(1) * Y / rho + uv_radius * X * X / rho3,
+             d_radius * d_theta(2) * Y / rho;
+    /** dP / dq of the unnormalized toRotationMatrix **/
+    Eigen::Matrix<double, 3, 4> dP_dq;
+    dP_dq << 2 * qy * b + 2 * qz * c, -4 * qy * a + 2 * qx * b + 2 * qw * c, -4 * qz * a - 2 * qw * b + 2 * qx * c, -2 * qz * b + 2 * qy * c,
+             2 * qy * a - 4 * qx * b - 2 * qw * c, 2 * qx * a + 2 * qz * c, 2 * qw * a - 4 * qz * b + 2 * qy * c, 2 * qz * a - 2 * qx * c,
+             2 * qz * a + 2 * qw * b - 4 * qx * c, -2 * qw * a + 2 * qz * b - 4 * qy * c, 2 * qx * a + 2 * qy * b, -2 * qy * a + 2 * qx * b;
+    const Eigen::Matrix<double, 2, 3> duv_dP = affine_inv * dp_dP;
+
+    Eigen::Matrix<double, 2, 7 + K_INT> &J = *jacobian;
+    J.block<2, 4>(0, 0) = duv_dP * dP_dq;
+    J.block<2, 3>(0, 4) = duv_dP;
+    J.col(7) = affine_inv.col(0);
+    J.col(8) = affine_inv.col(1);
+    double theta_k = 1;
+    for (int k = 0; k < 5; ++k) {
+        J.col(9 + k) = affine_inv * Eigen::Matrix<double, 2, 1>(theta_k * X / rho, theta_k * Y / rho);
+        theta_k *= theta;
+    }
+    J.col(14) << -U / det, pv / det - V / det;
+    J.col(15) << -pv / det + aff_e * U / det, aff_e * V / det;
+    J.col(16) << aff_d * U / det, -pu / det + aff_d * V / det;
+    return {U, V};
+}
+
 void saveResults(std::string &record_path, std::vector<double> params, double bandwidth, double initial_cost, double final_cost, double proj_error) {
     const std::vector<const char*> name = {
             "rx", "ry", "rz",
@@ -0,0 +1,230 @@
+#pragma once
+/** residual blocks of the calibration problem, shared by optimization.cpp and the jacobian test **/
+/** headings **/
+#include <optimization.h>
+#include <common_lib.h>
+
+/** residual of one lidar point, shared by the per point functor and the batched cost **/
+template <typename T, typename Interpolator>
+T kdeResidual(const T *const q_, const T *const t_, const T *const intrinsic_, const Vec3D &lid_point,
+              const Interpolator &interpolator, double weight, double ref_val, double scale) {
+    Eigen::Quaternion<T> q{q_[3], q_[0], q_[1], q_[2]};
+    Eigen::Matrix<T, 3, 3> R = q.toRotationMatrix();
+    Eigen::Matrix<T, 3, 1> t(t_);
+    Eigen::Matrix<T, K_INT, 1> intrinsic(intrinsic_);
+    Eigen::Matrix<T, 3, 1> lidar_point = R * lid_point.cast<T>() + t;
+    Eigen::Matrix<T, 2, 1> projection = IntrinsicTransform(intrinsic, lidar_point);
+    T val;
+    interpolator.Evaluate(projection(0) * T(scale), projection(1) * T(scale), &val);
+    return T(weight) * (T(ref_val) - val);
+}
+
+/** Interpolator is the bicubic patch over the kde grid or the precomputed GradientInterpolator **/
+template <typename Interpolator>
+struct QuaternionFunctor {
+    template <typename T>
+    bool operator()(const T *const q_, const T *const t_, const T *const intrinsic_, T *cost) const {
+        T res = kdeResidual(q_, t_, intrinsic_, lid_point_, kde_interpolator_, weight_, kde_val_, kde_scale_);
+        cost[0] = res;
+        cost[1] = res;
+        cost[2] = res;
+        return true;
+    }
+
+    QuaternionFunctor(const Vec3D lid_point,
+                    const double weight,
+                    const double ref_val,
+                    const double scale,
+                    const Interpolator &interpolator)
+                    : lid_point_(std::move(lid_point)), kde_interpolator_(interpolator), weight_(std::move(weight)), kde_val_(std::move(ref_val)), kde_scale_(std::move(scale)) {}
+
+    static ceres::CostFunction *Create(const Vec3D &lid_point,
+                                       const double &weight,
+                                       const double &kde_val,
+                                       const double &kde_scale,
+                                       const Interpolator &interpolator) {
+        return new ceres::AutoDiffCostFunction<QuaternionFunctor, 3, ((6+1)-3), 3, K_INT>(
+                new QuaternionFunctor(lid_point, weight, kde_val, kde_scale, interpolator));
+    }
+
+    const Vec3D lid_point_;
+    const double weight_;
+    const double kde_val_;
+    const double kde_scale_;
+    const Interpolator &kde_interpolator_;
+};
+
+/** up to BATCH_SIZE lidar points in one residual block, one residual per point **/
+/** the per point functor repeats its residual r three times under HuberLoss(kHuberDelta), the batch keeps **/
+/** that objective: with s = 3 r^2 each point emits sign(r) sqrt(rho(s)) and the jacobian scaled by rho'(s) 3 r / that **/
+/** residual only evaluations run the projection over the SoA chunk in plain double loops, **/
+/** jacobians come from the analytic projectionJacobian and the interpolator gradient **/
+/** the field is read through the binding on every evaluation, so a session can swap it between stages **/
+class QuaternionBatchCost : public ceres::CostFunction {
+public:
+    static constexpr double kHuberDelta = 0.05;
+
+    QuaternionBatchCost(const EdgeCloud &cloud, int begin, int end, const FieldBinding &binding)
+                        : binding_(binding) {
+        const int num_points = end - begin;
+        CHECK_LE(num_points, BATCH_SIZE);
+        x_.resize(num_points);
+        y_.resize(num_points);
+        z_.resize(num_points);
+        for (int i = 0; i < num_points; ++i) {
+            x_[i] = cloud.points[begin + i].x;
+            y_[i] = cloud.points[begin + i].y;
+            z_[i] = cloud.points[begin + i].z;
+        }
+        set_num_residuals(num_points);
+        mutable_parameter_block_sizes()->push_back(((6+1)-3));
+        mutable_parameter_block_sizes()->push_back(3);
+        mutable_parameter_block_sizes()->push_back(K_INT);
+    }
+
+    bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const override {
+        const KdeField &field = *binding_.field;
+        if (binding_.counters == nullptr) {
+            return (field.hasGradient()) ? evaluate(field.gradient(), field, parameters, residuals, jacobians)
+                                         : evaluate(field.interpolator(), field, parameters, residuals, jacobians);
+        }
+        const auto start_time = std::chrono::steady_clock::now();
+        const bool success = (field.hasGradient()) ? evaluate(field.gradient(), field, parameters, residuals, jacobians)
+                                                   : evaluate(field.interpolator(), field, parameters, residuals, jacobians);
+        const int64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_time).count();
+        (jacobians != nullptr ? binding_.counters->jacobianNs : binding_.counters->residualNs) += elapsed;
+        return success;
+    }
+
+private:
+    template <typename Interpolator>
+    bool evaluate(const Interpolator &interpolator, const KdeField &field,
+                  double const *const *parameters, double *residuals, double **jacobians) const {
+        const int num_points = x_.size();
+        const double weight = binding_.weight;
+        const bool need_jacobians = (jacobians != nullptr)
+                && (jacobians[0] != nullptr || jacobians[1] != nullptr || jacobians[2] != nullptr);
+        if (!need_jacobians) {
+            projectBatch(interpolator, field, parameters, residuals);
+            for (int i = 0; i < num_points; ++i) {
+                double scale;
+                residuals[i] = robustify(residuals[i], scale);
+            }
+            return true;
+        }
+
+        const int kBlockBegin[3] = {0, ((6+1)-3), (6+1)};
+        const int kBlockSize[3] = {((6+1)-3), 3, K_INT};
+        Eigen::Matrix<double, 2, 7 + K_INT> projection_jacobian;
+        for (int i = 0; i < num_points; ++i) {
+            const Vec3D lid_point = {x_[i], y_[i], z_[i]};
+            const Vec2D projection = projectionJacobian(parameters[0], parameters[1], parameters[2], lid_point, &projection_jacobian);
+            double val, dfdr, dfdc;
+            interpolator.Evaluate(projection(0) * field.scale, projection(1) * field.scale, &val, &dfdr, &dfdc);
+            double scale;
+            residuals[i] = robustify(weight * (field.refVal - val), scale);
+            /** d res / d params = -weight * kde_scale * grad(f) * d projection / d params **/
+            const Eigen::Matrix<double, 1, 7 + K_INT> gradient = (-scale * weight * field.scale)
+                    * (dfdr * projection_jacobian.row(0) + dfdc * projection_jacobian.row(1));
+            for (int b = 0; b < 3; ++b) {
+                if (jacobians[b] == nullptr) {
+                    continue;
+                }
+                for (int k = 0; k < kBlockSize[b]; ++k) {
+                    jacobians[b][i * kBlockSize[b] + k] = gradient(kBlockBegin[b] + k);
+                }
+            }
+        }
+        return true;
+    }
+
+    /** sign(r) sqrt(rho(3 r^2)) of HuberLoss, d_scale is its derivative w.r.t. r **/
+    static double robustify(double r, double &d_scale) {
+        const double kDelta2 = kHuberDelta * kHuberDelta;
+        const double s = 3 * r * r;
+        if (s <= kDelta2) {
+            d_scale = sqrt(3.0);
+            return sqrt(3.0) * r;
+        }
+        const double rho = 2 * kHuberDelta * sqrt(s) - kDelta2;
+        const double res = copysign(sqrt(rho), r);
+        d_scale = kHuberDelta / sqrt(s) * 3 * r / res;
+        return res;
+    }
+
+    /** same model as IntrinsicTransform, the affine inverse is formed once per chunk **/
+    template <typename Interpolator>
+    void projectBatch(const Interpolator &interpolator, const KdeField &field,
+                      double const *const *parameters, double *residuals) const {
+        const int num_points = x_.size();
+        const double *q_ = parameters[0], *t_ = parameters[1], *intrinsic = parameters[2];
+        const Mat3D R = Eigen::Quaterniond(q_[3], q_[0], q_[1], q_[2]).toRotationMatrix();
+        const double det = intrinsic[7] * 1.0 - intrinsic[9] * intrinsic[8];
+        const double inv00 = 1.0 / det, inv01 = -intrinsic[8] / det;
+        const double inv10 = -intrinsic[9] / det, inv11 = intrinsic[7] / det;
+        const double kde_scale = field.scale;
+        /** on the stack, residual only evaluations run once per block and line search step **/
+        double u[BATCH_SIZE], v[BATCH_SIZE];
+        #pragma omp simd
+        for (int i = 0; i < num_points; ++i) {
+            const double px = R(0, 0) * x_[i] + R(0, 1) * y_[i] + R(0, 2) * z_[i] + t_[0];
+            const double py = R(1, 0) * x_[i] + R(1, 1) * y_[i] + R(1, 2) * z_[i] + t_[1];
+            const double pz = R(2, 0) * x_[i] + R(2, 1) * y_[i] + R(2, 2) * z_[i] + t_[2];
+            const double xy_radius = sqrt(px * px + py * py);
+            const double theta = acos(pz / sqrt(px * px + py * py + pz * pz));
+            const double uv_radius = intrinsic[2] + theta * (intrinsic[3] + theta * (intrinsic[4] + theta * (intrinsic[5] + theta * intrinsic[6])));
+            const double pu = uv_radius / xy_radius * px + intrinsic[0];
+            const double pv = uv_radius / xy_radius * py + intrinsic[1];
+            u[i] = (inv00 * pu + inv01 * pv) * kde_scale;
+            v[i] = (inv10 * pu + inv11 * pv) * kde_scale;
+        }
+        for (int i = 0; i < num_points; ++i) {
+            double val;
+            interpolator.Evaluate(u[i], v[i], &val);
+            residuals[i] = binding_.weight * (field.refVal - val);
+        }
+    }
+
+    std::vector<double> x_, y_, z_;
+    const FieldBinding &binding_;
+};
+
+/** one lidar point with a single plain residual and hand derived jacobians, **/
+/** checked against the AutoDiff QuaternionFunctor by jacobianCheck **/
+template <typename Interpolator>
+class QuaternionAnalyticCost : public ceres::SizedCostFunction<1, ((6+1)-3), 3, K_INT> {
+public:
+    QuaternionAnalyticCost(const Vec3D &lid_point, double weight, double ref_val, double scale, const Interpolator &interpolator)
+                           : lid_point_(lid_point), weight_(weight), kde_val_(ref_val), kde_scale_(scale), kde_interpolator_(interpolator) {}
+
+    bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const override {
+        Eigen::Matrix<double, 2, 7 + K_INT> projection_jacobian;
+        const bool need_jacobians = (jacobians != nullptr);
+        const Vec2D projection = projectionJacobian(parameters[0], parameters[1], parameters[2], lid_point_,
+                                                    need_jacobians ? &projection_jacobian : nullptr);
+        double val, dfdr, dfdc;
+        kde_interpolator_.Evaluate(projection(0) * kde_scale_, projection(1) * kde_scale_, &val, &dfdr, &dfdc);
+        residuals[0] = weight_ * (kde_val_ - val);
+        if (need_jacobians) {
+            const Eigen::Matrix<double, 1, 7 + K_INT> gradient = (-weight_ * kde_scale_)
+                    * (dfdr * projection_jacobian.row(0) + dfdc * projection_jacobian.row(1));
+            if (jacobians[0] != nullptr) {
+                Eigen::Map<Eigen::Matrix<double, 1, ((6+1)-3)>>(jacobians[0]) = gradient.segment<((6+1)-3)>(0);
+            }
+            if (jacobians[1] != nullptr) {
+                Eigen::Map<Eigen::Matrix<double, 1, 3>>(jacobians[1]) = gradient.segment<3>(((6+1)-3));
+            }
+            if (jacobians[2] != nullptr) {
+                Eigen::Map<Eigen::Matrix<double, 1, K_INT>>(jacobians[2]) = gradient.segment<K_INT>(6+1);
+            }
+        }
+        return true;
+    }
+
+private:
+    const Vec3D lid_point_;
+    const double weight_;
+    const double kde_val_;
+    const double kde_scale_;
+    const Interpolator &kde_interpolator_;
+};
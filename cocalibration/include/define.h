@@ -6,6 +6,7 @@
 
 #define K_INT               (10)
 #define KDE_SCALE           (1)
+#define BATCH_SIZE          (256) // lidar points per residual block
 #define SAMPLING_RADIUS     (0.01)
 #define MESSAGE_EN          (1)
 #define EXTRA_FILE_EN       (0)
@@ -45,4 +46,5 @@ typedef pcl::PointCloud<pcl::PointXYZ>      EdgePixels;
 
 typedef std::vector< Eigen::Matrix3d, Eigen::aligned_allocator<Eigen::Matrix3d> > MatricesVector;
 typedef boost::shared_ptr< MatricesVector > MatricesVectorPtr;
-typedef std::pair<int, int>                 Pair;
\ No newline at end of file
+typedef std::pair<int, int>                 Pair;
+typedef float                               KdeScalar; // storage of the kde grids, double doubles the memory
\ No newline at end of file
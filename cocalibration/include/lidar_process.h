@@ -6,6 +6,10 @@
 #include <thread>
 #include <tuple>
 #include <numeric>
+#include <omp.h>
+#include <atomic>
+#include <unordered_map>
+#include <map>
 /** ros **/
 #include <ros/ros.h>
 #include <ros/package.h>
@@ -22,7 +26,6 @@
 #include <pcl/filters/filter.h>
 #include <pcl/filters/conditional_removal.h>
 #include <pcl/filters/radius_outlier_removal.h>
-#include <pcl/filters/uniform_sampling.h>
 #include <pcl/filters/extract_indices.h>
 #include <pcl/kdtree/kdtree_flann.h>
 #include <pcl/common/transforms.h>
@@ -41,9 +44,31 @@ using namespace std;
 class LidarProcess{
 public:
     CloudI::Ptr lidarCartCloud;
-    CloudI::Ptr lidarPolarCloud;
-    EdgeCloud::Ptr lidarEdgeCloud; // lidar edge points
+    /** polar points as structure of arrays, index refers to lidarCartCloud **/
+    struct PolarPoints {
+        vector<float> theta;
+        vector<float> phi;
+        vector<float> range;
+        vector<float> intensity;
+        vector<int> index;
+        int size() const { return theta.size(); }
+        void resize(int n) {
+            theta.resize(n);
+            phi.resize(n);
+            range.resize(n);
+            intensity.resize(n);
+            index.resize(n);
+        }
+    };
+    PolarPoints lidarPolarPoints;
+    EdgeCloud::Ptr lidarEdgeCloud; // lidar edge points of the selected pyramid level
+    vector<EdgeCloud::Ptr> lidarEdgePyramid; // level l is built on a flat image downsampled by 2^l
     int NUM_SPOT = 1;
+    int kPyramidLevels = 1;
+    float kVoxelSize = 0.005;
+    bool kSaveEdgeImages = false;
+    int kEdgeTiles = 1;
+    bool kEdgeTileCheck = false;
     string TOPIC_NAME = "/livox/lidar";
     Pair kFlatImageSize = {2000, 4000};
     const float kRadPerPix = (M_PI * 2) / kFlatImageSize.second;
@@ -54,25 +79,40 @@ public:
     string COCALIB_PATH;
     string EDGE_PATH;
     string RESULT_PATH;
-    string PYSCRIPT_PATH; 
 
+    string lidarMaskPath;
+    string cocalibBagPath;
     string cocalibCloudPath;
     string flatImagePath;
     string lidarEdgeCloudPath;
     string lidarEdgeImagePath;
     /** tags and maps **/
-    typedef vector<int> Tags;
-    vector<vector<Tags>> tagsMap;
+    /** compressed sparse rows: the point indices tagged to pixel (u, v) are **/
+    /** indices[offsets[u * cols + v]] ... indices[offsets[u * cols + v + 1] - 1] **/
+    struct TagsMap {
+        int rows = 0;
+        int cols = 0;
+        vector<int> offsets;
+        vector<int> indices;
+        const int *begin(int u, int v) const { return indices.data() + offsets[u * cols + v]; }
+        const int *end(int u, int v) const { return indices.data() + offsets[u * cols + v + 1]; }
+    };
+    TagsMap tagsMap;
+    cv::Mat flatImage;
+    cv::Mat edgeImage;
     /***** Extrinsic Parameters *****/
     Ext_D ext_;
 
 public:
     /** Funcs **/
-    LidarProcess();
+    LidarProcess(int spot = -1);
+    bool accumulateBag();
     void cartToSphere();
-    void sphereToPlane();
-    void edgeExtraction();
-    void generateEdgeCloud();
+    void sphereToPlane(int level = 0);
+    void edgeExtraction(int level = 0);
+    bool generateEdgeCloud(int level = 0);
+    int pyramidLevel(double bandwidth);
+    void selectPyramidLevel(double bandwidth);
     /***** Evaluation *****/
     double getEdgeDistance(EdgeCloud::Ptr cloud_tgt, EdgeCloud::Ptr cloud_src, float max_range);
     double getFitnessScore(CloudI::Ptr cloud_tgt, CloudI::Ptr cloud_src, float max_range);
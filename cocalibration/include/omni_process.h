@@ -3,9 +3,16 @@
 #include <stdlib.h>
 #include <iostream>
 #include <unordered_map>
+#include <map>
+#include <memory>
 #include <string>
 #include <vector>
 #include <cmath>
+#include <chrono>
+#include <fstream>
+#include <numeric>
+#include <algorithm>
+#include <omp.h>
 #include <thread>
 #include <time.h>
 /** opencv **/
@@ -18,24 +25,117 @@
 /** ros **/
 #include <ros/ros.h>
 #include <ros/package.h>
-/** mlpack **/
-#include <mlpack/core.hpp>
-#include <mlpack/methods/kde/kde.hpp>
-#include <mlpack/core/tree/octree.hpp>
-#include <mlpack/core/tree/cover_tree.hpp>
+/** ceres **/
+#include "ceres/cubic_interpolation.h"
 /** headings **/
 #include <define.h>
 /** namespace **/
 using namespace std;
 
+/** bilinear lookup of value and gradient from an interleaved [v, dv/dr, dv/dc] grid **/
+/** the gradients are the central differences that the bicubic interpolator uses at the grid nodes, **/
+/** so the cost surface matches BiCubicInterpolator up to the interpolation order at a few loads per point **/
+class GradientInterpolator {
+public:
+    GradientInterpolator(const KdeScalar *data, int rows, int cols) : data(data), rows(rows), cols(cols) {}
+
+    void Evaluate(double r, double c, double *f, double *dfdr, double *dfdc) const {
+        /** the field is constant beyond the border, as the clamped Grid2D **/
+        const bool in_rows = (r >= 0 && r <= this->rows - 1), in_cols = (c >= 0 && c <= this->cols - 1);
+        r = std::min(std::max(r, 0.0), (double)(this->rows - 1));
+        c = std::min(std::max(c, 0.0), (double)(this->cols - 1));
+        const int r0 = std::max(0, std::min((int)r, this->rows - 2));
+        const int c0 = std::max(0, std::min((int)c, this->cols - 2));
+        const double a = r - r0, b = c - c0;
+        const KdeScalar *p00 = this->data + 3 * ((size_t)r0 * this->cols + c0);
+        const KdeScalar *p01 = p00 + 3, *p10 = p00 + 3 * this->cols, *p11 = p10 + 3;
+        const double w00 = (1 - a) * (1 - b), w01 = (1 - a) * b, w10 = a * (1 - b), w11 = a * b;
+        *f = w00 * p00[0] + w01 * p01[0] + w10 * p10[0] + w11 * p11[0];
+        if (dfdr != nullptr) {
+            *dfdr = in_rows ? (w00 * p00[1] + w01 * p01[1] + w10 * p10[1] + w11 * p11[1]) : 0.0;
+        }
+        if (dfdc != nullptr) {
+            *dfdc = in_cols ? (w00 * p00[2] + w01 * p01[2] + w10 * p10[2] + w11 * p11[2]) : 0.0;
+        }
+    }
+
+    void Evaluate(const double &r, const double &c, double *f) const {
+        Evaluate(r, c, f, nullptr, nullptr);
+    }
+
+    template <typename JetT>
+    void Evaluate(const JetT &r, const JetT &c, JetT *f) const {
+        double frc, dfdr, dfdc;
+        Evaluate(r.a, c.a, &frc, &dfdr, &dfdc);
+        f->a = frc;
+        f->v = dfdr * r.v + dfdc * c.v;
+    }
+
+private:
+    const KdeScalar *data;
+    int rows;
+    int cols;
+};
+
+/** kde of the omni edge pixels at one bandwidth, grid index (i, j) samples the pixel (i / scale, j / scale) **/
+/** owns the grid, computed or mapped from the kde cache, and the interpolator over it, shared by reference **/
+class KdeField {
+public:
+    double bandwidth = 0;
+    double scale = 1;
+    int rows = 0;
+    int cols = 0;
+    double refVal = 0; // maximum of the field
+
+    KdeField(double bandwidth, double scale, int rows, int cols);
+    KdeField(const KdeField &) = delete;
+    KdeField &operator=(const KdeField &) = delete;
+    KdeScalar *data() { return this->grid.data(); }
+    const KdeScalar *values() const { return this->mapped ? this->mapped.get() : this->grid.data(); }
+    void allocate();
+    void map(std::shared_ptr<const KdeScalar> mapped_grid, double ref_val);
+    void build();
+    const ceres::BiCubicInterpolator<ceres::Grid2D<KdeScalar>> &interpolator() const { return *this->bicubic; }
+    void buildGradient();
+    bool hasGradient() const { return this->gradientLookup != nullptr; }
+    const GradientInterpolator &gradient() const { return *this->gradientLookup; }
+
+private:
+    std::vector<KdeScalar> grid; // computed grid
+    std::shared_ptr<const KdeScalar> mapped; // grid mapped from the kde cache, grid stays empty then
+    std::unique_ptr<ceres::Grid2D<KdeScalar>> gridAdapter;
+    std::unique_ptr<ceres::BiCubicInterpolator<ceres::Grid2D<KdeScalar>>> bicubic;
+    std::vector<KdeScalar> gradientGrid; // interleaved [v, dv/dr, dv/dc]
+    std::unique_ptr<GradientInterpolator> gradientLookup;
+};
+
+/** edge pixels grouped by row, shared by the direct kde of every bandwidth **/
+struct KdeEdgeRows {
+    std::vector<int> rowBegin;
+    std::vector<double> cols;
+    std::vector<double> sumC;
+    std::vector<double> sumC2;
+};
+
 class OmniProcess{
 public:
     /** Essential Params **/
     cv::Mat cocalibImage;
+    cv::Mat edgeImage;
     EdgeCloud::Ptr ocamEdgeCloud; // edge pixels
     Pair kImageSize = {2048, 2448};
     Pair kEffectiveRadius = {300, 1100};
     int kExcludeRadius = 200;
+    int kEdgeTiles = 1;
+    double kKdeFftBandwidth = 16; // kde bandwidths from here on use the DFT engine
+    double kKdeCoarseBandwidth = 0; // > 0: wider bandwidths are sampled at KDE_SCALE * kKdeCoarseBandwidth / bandwidth
+    std::map<double, std::unique_ptr<KdeField>> kdeFields;
+    bool kSaveEdgeImages = false;
+    bool kKdeCache = false;
+    bool kDistanceField = false; // cost fields are max(0, 1 - d^2 / bw^2) of the edge distance d instead of the kde
+    bool kKdeGradient = false; // residuals read value and gradient from a precomputed grid instead of the bicubic patch
+    bool kKdeAnnulus = false; // kde is only evaluated inside the outer effective radius widened by kKdeMargin, 0 outside
+    double kKdeMargin = 64; // pixels, covers the principal point range and the bicubic support
     /** File Directory Path **/
     int NUM_SPOT = 1;
     string DATASET_NAME;
@@ -44,20 +144,33 @@ public:
     string COCALIB_PATH;
     string EDGE_PATH;
     string RESULT_PATH;
-    string PYSCRIPT_PATH; 
 
+    string omniMaskPath;
     string cocalibImagePath;
     string cocalibEdgeImagePath;
     string cocalibEdgeCloudPath;
-    string cocalibKdePath;
+    string kdeCachePath;
     /***** Intrinsic Params *****/
     Int_D int_;
 
 public:
     /** Funcs **/
-    OmniProcess();
+    OmniProcess(int spot = -1);
     void loadCocalibImage();
     void edgeExtraction();
     void generateEdgeCloud();
-    std::vector<double> Kde(double bandwidth, double scale);
+    double kdeScale(double bandwidth);
+    void kdePyramid(const std::vector<double> &bandwidths);
+    const KdeField &kdeField(double bandwidth);
+    KdeEdgeRows kdeEdgeRows();
+    void kdeDirect(const KdeEdgeRows &edge_rows, KdeField &field);
+    void kdeFft(const cv::Mat &mask_spectrum, KdeField &field);
+    std::vector<float> edgeDistance();
+    void distanceField(const std::vector<float> &edge_dist, KdeField &field);
+    int kdeRowRanges(const KdeField &field, int i, int ranges[4]);
+    double kdeNormalizer(double bandwidth);
+    uint64_t kdeKey(const KdeField &field);
+    string kdeCacheFile(uint64_t key);
+    bool loadKdeCache(KdeField &field);
+    void saveKdeCache(const KdeField &field);
 };
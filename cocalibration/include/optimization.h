@@ -4,6 +4,15 @@
 #include <string>
 #include <vector>
 #include <thread>
+#include <type_traits>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <array>
+#include <deque>
+#include <random>
+#include <atomic>
+#include <numeric>
 // eigen
 #include <Eigen/Core>
 // ros
@@ -47,18 +56,153 @@ inline double getDouble(const ceres::Jet<SCALAR, N> &x) {
 
 double project2Image(OmniProcess &fisheye, LidarProcess &lidar, std::vector<double> &params, std::string record_path, double bandwidth);
 
-std::vector<double> QuaternionCalib(OmniProcess &fisheye,
-                                    LidarProcess &lidar,
-                                    double bandwidth,
-                                    std::vector<int> spot_vec,
-                                    std::vector<double> init_params_vec,
-                                    std::vector<double> lb,
-                                    std::vector<double> ub,
-                                    bool lock_intrinsic);
+/** evaluation time of the batched residuals summed over the ceres threads, in ns **/
+struct EvalCounters {
+    std::atomic<int64_t> residualNs{0};
+    std::atomic<int64_t> jacobianNs{0};
+};
+
+/** the batched residuals read the cost field through this binding **/
+struct FieldBinding {
+    const KdeField *field = nullptr;
+    double weight = 1;
+    EvalCounters *counters = nullptr; // evaluations are timed when set
+};
+
+/** the omni image and lidar cloud of one stationary spot **/
+struct CalibSpot {
+    OmniProcess *omni;
+    LidarProcess *lidar;
+};
+
+/** one ceres problem kept across the bandwidth schedule, only the field behind the residuals is swapped **/
+/** several spots share the intrinsic block, and the extrinsic blocks unless spot_extrinsics **/
+class CalibSession {
+public:
+    CalibSession(OmniProcess &omni,
+                 LidarProcess &lidar,
+                 std::vector<double> init_params_vec,
+                 std::vector<double> lb,
+                 std::vector<double> ub,
+                 bool lock_intrinsic);
+    CalibSession(std::vector<CalibSpot> spots,
+                 std::vector<double> init_params_vec,
+                 std::vector<double> lb,
+                 std::vector<double> ub,
+                 bool lock_intrinsic,
+                 bool spot_extrinsics);
+    CalibSession(const CalibSession &) = delete;
+    CalibSession &operator=(const CalibSession &) = delete;
+    std::vector<double> solve(double bandwidth);
+    /** solve split into its steps, prepare and record use omni and lidar, optimize only the session **/
+    void prepare(double bandwidth);
+    void optimize();
+    std::vector<double> record(double bandwidth);
+    void revertStage();
+    void setParams(std::vector<double> params_vec);
+    std::vector<double> getParams(int spot = 0) const;
+    /** cost of the current parameters over the whole edge clouds of the prepared stage, culled points included **/
+    double fullCost() const;
+
+    ceres::Solver::Summary summary; // of the last stage
+    int numThreads = std::thread::hardware_concurrency(); // ceres threads of one solve
+    bool verbose = true; // per iteration progress on stdout
+    bool kSolverTelemetry = false; // per iteration csv in RESULT_PATH of spot 0
+    std::string telemetryTag; // appended to the csv name
+    bool kVisibilityCull = false; // residual blocks only for edge points that can reach the omni annulus
+
+private:
+    static constexpr double kCullDriftRatio = 0.25; // of the stage rotation, larger culls less and rebuilds less often
+
+    void buildProblem();
+
+    std::vector<CalibSpot> spots;
+    std::vector<double> lb;
+    std::vector<double> ub;
+    bool lockIntrinsic;
+    bool spotExtrinsics;
+    std::vector<std::array<double, (6+1)>> extrinsics; // [qx, qy, qz, qw, tx, ty, tz], one per spot or one shared
+    double intrinsic[K_INT];
+    std::vector<FieldBinding> bindings; // per spot
+    std::vector<EdgeCloud::Ptr> edgeClouds; // edge cloud levels the residual blocks were built from
+    std::unique_ptr<ceres::Problem> problem;
+    EvalCounters counters;
+    double bandwidth = 0; // of the prepared stage
+    std::vector<std::array<double, (6+1)>> stageExtrinsics; // parameters the prepared stage started from
+    double stageIntrinsic[K_INT];
+    std::vector<std::array<double, (6+1)>> cullExtrinsics; // parameters the culling was done with
+    double cullBandwidth = 0;
+    double cullRotation; // rad, rotation margin of the culling, stage rotation plus cullDrift
+    double cullDrift; // rad, rotation of a stage start from cullExtrinsics that keeps the culling valid
+};
+
+/** independent sessions from perturbed starts, solved concurrently, the lowest final cost wins each stage **/
+class MultiStartCalib {
+public:
+    MultiStartCalib(std::vector<CalibSpot> spots,
+                    std::vector<double> init_params_vec,
+                    std::vector<double> lb,
+                    std::vector<double> ub,
+                    int num_starts,
+                    bool lock_intrinsic,
+                    bool spot_extrinsics);
+    std::vector<double> solve(double bandwidth);
+    void revertStage();
+    const CalibSession &best() const { return *this->sessions[this->bestIndex]; }
+
+private:
+    static constexpr unsigned kSeed = 2023;
+    static constexpr double kAgreeTolerance = 0.01; // relative final cost of starts counted as converged to the best
+
+    LidarProcess &lidar;
+    std::vector<std::unique_ptr<CalibSession>> sessions;
+    int numWorkers;
+    int bestIndex = 0; // of the last stage
+};
+
+/** bandwidth list adapted to the outcome of each stage, see update **/
+class BandwidthScheduler {
+public:
+    BandwidthScheduler(std::vector<double> bw, std::vector<double> params_range);
+    bool empty() const { return this->queue.empty(); }
+    double next();
+    /** params of every spot before and after the stage, the worst spot decides, **/
+    /** records the decision in the record path of every spot, false: the stage result is discarded **/
+    bool update(double bandwidth,
+                const std::vector<std::vector<double>> &init_spot_vecs,
+                const std::vector<std::vector<double>> &result_spot_vecs,
+                const ceres::Solver::Summary &summary,
+                const std::vector<std::string> &record_paths);
+
+private:
+    static constexpr double kPinnedRatio = 0.9; // of Q_LIM, quaternion steps this large are held by the stage bounds
+
+    std::deque<double> queue;
+    std::vector<double> paramsRange;
+    double kRotTol = 1e-4; // rad
+    double kTransTol = 1e-4; // m
+    double kIntTol = 1e-3; // of the intrinsic ranges
+    double kCostTol = 1e-3; // relative cost reduction
+    int kMaxInserts = 2;
+    int numInserts = 0;
+    double kept = 0; // bandwidth of the last kept stage
+};
 
 void costAnalysis(OmniProcess &fisheye,
-                        LidarProcess &lidar,
-                        std::vector<int> spot_vec,
-                        std::vector<double> init_params_vec,
-                        std::vector<double> result_vec,
-                        double bandwidth);
\ No newline at end of file
+                  LidarProcess &lidar,
+                  std::vector<double> init_params_vec,
+                  std::vector<double> result_vec,
+                  double bandwidth);
+
+void fieldBenchmark(OmniProcess &omni,
+                    LidarProcess &lidar,
+                    std::vector<double> params,
+                    std::vector<double> params_range,
+                    std::vector<double> bw,
+                    std::vector<double> lb,
+                    std::vector<double> ub);
+
+double jacobianCheck(OmniProcess &omni,
+                     LidarProcess &lidar,
+                     std::vector<double> params_vec,
+                     double bandwidth);
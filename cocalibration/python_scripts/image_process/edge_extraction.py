@@ -1,3 +1,6 @@
+# Reference implementation of the edge extraction, no longer called by the package.
+# OmniProcess::edgeExtraction and LidarProcess::edgeExtraction run the same chain in process,
+# level 0 of their pyramid matches this script, coarser levels scale its radii and thresholds.
 import os, sys
 import numpy as np
 import cv2
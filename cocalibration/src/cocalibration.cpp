@@ -3,6 +3,10 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <memory>
 /** opencv **/
 #include <opencv2/opencv.hpp>
 /** ros **/
@@ -33,10 +37,22 @@ int main(int argc, char** argv) {
     bool kMultiSpotOpt = false;
     bool kParamsAnalysis = false;
     bool kUniformSampling = false;
+    bool kBagAccumulation = false;
+    bool kFieldBenchmark = false;
+    bool kJacobianCheck = false;
+    bool kSpotExtrinsics = false;
+    bool kAdaptiveSchedule = false;
+    int kMultiStarts = 1;
     nh.param<bool>("switch/kCeresOpt", kCeresOpt, false);
     nh.param<bool>("switch/kMultiSpotOpt", kMultiSpotOpt, false);
     nh.param<bool>("switch/kParamsAnalysis", kParamsAnalysis, false);
     nh.param<bool>("switch/kUniformSampling", kUniformSampling, false);
+    nh.param<bool>("switch/kBagAccumulation", kBagAccumulation, false);
+    nh.param<bool>("switch/kFieldBenchmark", kFieldBenchmark, false);
+    nh.param<bool>("switch/kJacobianCheck", kJacobianCheck, false);
+    nh.param<bool>("switch/kSpotExtrinsics", kSpotExtrinsics, false);
+    nh.param<bool>("switch/kAdaptiveSchedule", kAdaptiveSchedule, false);
+    nh.param<int>("essential/kMultiStarts", kMultiStarts, 1);
     /** Initialization **/
     std::vector<double> bw;
     nh.param<vector<double>>("cocalib/bw", bw, {32, 16, 8, 4, 2, 1});
@@ -92,16 +108,29 @@ int main(int argc, char** argv) {
     cout << "CHECK ROS PARAMS!" << rx << " " << ry << " " << rz << " " << a0 << endl;
 
     /***** Class Object Initialization *****/
-    OmniProcess omni;
-    LidarProcess lidar;
-    lidar.ext_ = Eigen::Map<Param_D>(params_init.data()).head(6);
-    omni.int_ = Eigen::Map<Param_D>(params_init.data()).tail(K_INT);
+    /** the spots of a multi spot dataset are calibrated jointly, otherwise the single spot layout is used **/
+    int num_spot = 1;
+    ros::param::get("essential/kNumSpot", num_spot);
+    const bool multi_spot = kMultiSpotOpt && num_spot > 1;
+    num_spot = multi_spot ? num_spot : 1;
+    vector<unique_ptr<OmniProcess>> omni_spots;
+    vector<unique_ptr<LidarProcess>> lidar_spots;
+    vector<CalibSpot> spots;
+    for (int spot = 0; spot < num_spot; ++spot) {
+        omni_spots.emplace_back(new OmniProcess(multi_spot ? spot : -1));
+        lidar_spots.emplace_back(new LidarProcess(multi_spot ? spot : -1));
+        spots.push_back({omni_spots.back().get(), lidar_spots.back().get()});
+        lidar_spots.back()->ext_ = Eigen::Map<Param_D>(params_init.data()).head(6);
+        omni_spots.back()->int_ = Eigen::Map<Param_D>(params_init.data()).tail(K_INT);
 
-    /***** Folder Check **/
-    CheckFolder(lidar.DATASET_PATH);
-    CheckFolder(lidar.COCALIB_PATH);
-    CheckFolder(lidar.EDGE_PATH);
-    CheckFolder(lidar.RESULT_PATH);
+        /***** Folder Check **/
+        CheckFolder(lidar_spots.back()->DATASET_PATH);
+        CheckFolder(lidar_spots.back()->COCALIB_PATH);
+        CheckFolder(lidar_spots.back()->EDGE_PATH);
+        CheckFolder(lidar_spots.back()->RESULT_PATH);
+    }
+    OmniProcess &omni = *omni_spots[0];
+    LidarProcess &lidar = *lidar_spots[0];
 
     /***** Calibration and Optimization Cost Analysis *****/
     if (kCeresOpt) {
@@ -115,40 +144,107 @@ int main(int argc, char** argv) {
         params_mat.row(1) = params_mat.row(0) - Eigen::Map<Eigen::Matrix<double, 1, 17>>(params_range.data());
         params_mat.row(2) = params_mat.row(0) + Eigen::Map<Eigen::Matrix<double, 1, 17>>(params_range.data());
         /********* Pre Processing *********/
-        cout << "----------------- Ocam Processing ---------------------" << endl;
-        omni.loadCocalibImage();
-        omni.edgeExtraction();
-        omni.generateEdgeCloud();
-        cout << "----------------- LiDAR Processing ---------------------" << endl;
-        lidar.cartToSphere();
-        lidar.sphereToPlane();
-        lidar.edgeExtraction();
-        lidar.generateEdgeCloud();
-        /********* Init Viz *********/
-        std::string fusion_image_path_init = omni.RESULT_PATH + "/fusion_image_init.bmp";
-        std::string cocalib_result_path_init = lidar.RESULT_PATH + "/cocalib_init.txt";
-        double proj_error = project2Image(omni, lidar, params_init, fusion_image_path_init, 0); // 0 - invalid bandwidth to initialize the visualization
-        saveResults(cocalib_result_path_init, params_init, 0, 0, 0, proj_error);
-        
-        std::vector<int> spot_vec;
-        if (lidar.NUM_SPOT == 1) {
-            if (kMultiSpotOpt && lidar.NUM_SPOT != 1) {
-                vector<int> spot_init_vec(lidar.NUM_SPOT);
-                std::iota(spot_init_vec.begin(), spot_init_vec.end(), 0);
-                spot_vec = spot_init_vec;
+        /** the omni and lidar pipelines of every spot are independent tasks, **/
+        /** the workers are capped since each pipeline runs its own omp teams **/
+        vector<function<void()>> tasks;
+        atomic<bool> failed(false);
+        for (int spot = 0; spot < num_spot; ++spot) {
+            OmniProcess &spot_omni = *omni_spots[spot];
+            LidarProcess &spot_lidar = *lidar_spots[spot];
+            tasks.emplace_back([&spot_omni, &bw, spot]() {
+                cout << "----------------- Ocam Processing: spot " << spot << " ---------------------" << endl;
+                spot_omni.loadCocalibImage();
+                spot_omni.edgeExtraction();
+                spot_omni.generateEdgeCloud();
+                spot_omni.kdePyramid(bw);
+            });
+            tasks.emplace_back([&spot_lidar, &failed, kBagAccumulation, spot]() {
+                cout << "----------------- LiDAR Processing: spot " << spot << " ---------------------" << endl;
+                if (kBagAccumulation && !spot_lidar.accumulateBag()) {
+                    failed = true;
+                    return;
+                }
+                spot_lidar.cartToSphere();
+                /** coarsest level first, the flat and edge images left on disk are the full resolution ones **/
+                for (int level = spot_lidar.kPyramidLevels - 1; level >= 0; --level) {
+                    spot_lidar.sphereToPlane(level);
+                    spot_lidar.edgeExtraction(level);
+                    if (!spot_lidar.generateEdgeCloud(level)) {
+                        failed = true;
+                        return;
+                    }
+                }
+            });
+        }
+        const int num_workers = min<int>(tasks.size(), max(2u, thread::hardware_concurrency() / THREADS));
+        atomic<int> next_task(0);
+        vector<thread> workers;
+        for (int w = 0; w < num_workers; ++w) {
+            workers.emplace_back([&]() {
+                for (int t = next_task++; t < (int)tasks.size(); t = next_task++) {
+                    tasks[t]();
+                }
+            });
+        }
+        for (auto &worker : workers) {
+            worker.join();
+        }
+        if (failed) {
+            ROS_ERROR("Pre processing failed, see the errors above.");
+            return 1;
+        }
+        if (kJacobianCheck) {
+            for (double bandwidth : bw) {
+                jacobianCheck(omni, lidar, params_init, bandwidth);
             }
-            else {
-                spot_vec = {0};
+        }
+        /********* Init Viz *********/
+        for (const CalibSpot &spot : spots) {
+            std::string fusion_image_path_init = spot.omni->RESULT_PATH + "/fusion_image_init.bmp";
+            std::string cocalib_result_path_init = spot.lidar->RESULT_PATH + "/cocalib_init.txt";
+            double proj_error = project2Image(*spot.omni, *spot.lidar, params_init, fusion_image_path_init, 0); // 0 - invalid bandwidth to initialize the visualization
+            saveResults(cocalib_result_path_init, params_init, 0, 0, 0, proj_error);
+        }
+
+        cout << "----------------- Ceres Optimization ---------------------" << endl;
+        std::unique_ptr<CalibSession> session;
+        std::unique_ptr<MultiStartCalib> multi_start;
+        if (kMultiStarts > 1) {
+            multi_start.reset(new MultiStartCalib(spots, params_cocalib, lb, ub, kMultiStarts, false, kSpotExtrinsics));
+        }
+        else {
+            session.reset(new CalibSession(spots, params_cocalib, lb, ub, false, kSpotExtrinsics));
+        }
+        BandwidthScheduler scheduler(bw, params_range);
+        /** params of every spot after the last kept stage, the extrinsics differ with kSpotExtrinsics **/
+        vector<vector<double>> spot_params(num_spot, params_cocalib);
+        while (!scheduler.empty()) {
+            double bandwidth = scheduler.next();
+            vector<double> result_vec = (multi_start) ? multi_start->solve(bandwidth) : session->solve(bandwidth);
+            const CalibSession &solved = (multi_start) ? multi_start->best() : *session;
+            vector<vector<double>> spot_results;
+            for (int spot = 0; spot < num_spot; ++spot) {
+                spot_results.push_back(solved.getParams(spot));
             }
-            cout << "----------------- Ceres Optimization ---------------------" << endl;
-            for (int i = 0; i < bw.size(); i++) {
-                double bandwidth = bw[i];
-                vector<double> init_params_vec(params_cocalib);
-                params_cocalib = QuaternionCalib(omni, lidar, bandwidth, spot_vec, params_cocalib, lb, ub, false);
-                if (kParamsAnalysis) {
-                    costAnalysis(omni, lidar, spot_vec, init_params_vec, params_cocalib, bandwidth);
+            if (kAdaptiveSchedule) {
+                vector<std::string> cocalib_result_paths;
+                for (const CalibSpot &spot : spots) {
+                    cocalib_result_paths.push_back(spot.lidar->RESULT_PATH + "/cocalib_" + std::to_string((int)bandwidth) + ".txt");
+                }
+                if (!scheduler.update(bandwidth, spot_params, spot_results, solved.summary, cocalib_result_paths)) {
+                    (multi_start) ? multi_start->revertStage() : session->revertStage();
+                    continue;
                 }
             }
+            params_cocalib = result_vec;
+            for (int spot = 0; spot < num_spot && kParamsAnalysis; ++spot) {
+                costAnalysis(*spots[spot].omni, *spots[spot].lidar, spot_params[spot], spot_results[spot], bandwidth);
+            }
+            spot_params = spot_results;
+        }
+        /** around the calibrated params, the fields of the schedule are rebuilt for both kinds **/
+        if (kFieldBenchmark) {
+            fieldBenchmark(omni, lidar, params_cocalib, params_range, bw, lb, ub);
         }
     }
     return 0;
@@ -1,31 +1,42 @@
 /** headings **/
 #include <lidar_process.h>
 #include <common_lib.h>
+#include <polar_kernel.h>
 
 /** namespace **/
 using namespace std;
 using namespace cv;
 using namespace Eigen;
 
-LidarProcess::LidarProcess(){
+LidarProcess::LidarProcess(int spot){
     /** Param **/
     ros::param::get("essential/kDatasetName", this->DATASET_NAME);
     ros::param::get("essential/kNumSpot", this->NUM_SPOT);
     ros::param::get("essential/kLidarTopic", this->TOPIC_NAME);
     ros::param::get("essential/kFlatRows", this->kFlatImageSize.first);
     ros::param::get("essential/kFlatCols", this->kFlatImageSize.second);
+    ros::param::get("essential/kPyramidLevels", this->kPyramidLevels);
+    this->kPyramidLevels = max(this->kPyramidLevels, 1);
+    ros::param::get("essential/kVoxelSize", this->kVoxelSize);
+    ros::param::get("switch/kSaveEdgeImages", this->kSaveEdgeImages);
+    ros::param::get("switch/kEdgeTileCheck", this->kEdgeTileCheck);
+    ros::param::get("essential/kLidarEdgeTiles", this->kEdgeTiles);
 
     this->lidarCartCloud.reset(new pcl::PointCloud<PointI>);
-    this->lidarPolarCloud.reset(new pcl::PointCloud<PointI>);
-    this->lidarEdgeCloud.reset(new pcl::PointCloud<pcl::PointXYZ>);
+    for (int level = 0; level < this->kPyramidLevels; ++level) {
+        this->lidarEdgePyramid.emplace_back(new pcl::PointCloud<pcl::PointXYZ>);
+    }
+    this->lidarEdgeCloud = this->lidarEdgePyramid[0];
     /** Path **/
     this->PKG_PATH = ros::package::getPath("cocalibration");
     this->DATASET_PATH = this->PKG_PATH + "/data/" + this->DATASET_NAME;
-    this->COCALIB_PATH = this->DATASET_PATH + "/cocalibration";
+    /** spot s of a multi spot dataset lives in cocalibration/spot<s> **/
+    this->COCALIB_PATH = this->DATASET_PATH + "/cocalibration" + ((spot < 0) ? "" : "/spot" + to_string(spot));
     this->EDGE_PATH = this->COCALIB_PATH + "/edges";
     this->RESULT_PATH = this->COCALIB_PATH + "/results";
-    this->PYSCRIPT_PATH = this->PKG_PATH + "/python_scripts/image_process/edge_extraction.py";
 
+    this->lidarMaskPath = this->PKG_PATH + "/python_scripts/image_process/lidar_flat_image_mask.png";
+    this->cocalibBagPath = this->COCALIB_PATH + "/lidar.bag";
     this->cocalibCloudPath = this->COCALIB_PATH + "/full_fov_cloud.pcd";
     this->flatImagePath = this->COCALIB_PATH + "/flat_lidar_image.bmp";
     this->lidarEdgeCloudPath = this->EDGE_PATH + "/lidar_edge_cloud.pcd";
@@ -33,99 +44,260 @@ LidarProcess::LidarProcess(){
 }
 
 /** Data Pre-processing **/
+bool LidarProcess::accumulateBag() {
+    cout << "----- LiDAR: AccumulateBag -----" << endl;
+    /** scans are merged message by message into a voxel hash, memory grows with the occupied voxels only **/
+    struct Voxel {
+        float x = 0, y = 0, z = 0, intensity = 0;
+        int num = 0;
+    };
+    unordered_map<uint64_t, Voxel> voxels;
+    long num_scan_points = 0;
+    int num_msgs = 0;
+
+    /** message types other than PointCloud2, e.g. livox_ros_driver/CustomMsg, are counted and reported **/
+    map<string, int> skipped_types;
+
+    rosbag::Bag bag;
+    try {
+        bag.open(this->cocalibBagPath, rosbag::bagmode::Read);
+    }
+    catch (const rosbag::BagException &e) {
+        ROS_ERROR("Open lidar bag failure: %s (%s)", this->cocalibBagPath.c_str(), e.what());
+        return false;
+    }
+    rosbag::View view(bag, rosbag::TopicQuery(vector<string>{this->TOPIC_NAME}));
+    CloudI scan;
+    for (const rosbag::MessageInstance &msg : view) {
+        sensor_msgs::PointCloud2ConstPtr scan_msg = msg.instantiate<sensor_msgs::PointCloud2>();
+        if (scan_msg == nullptr) {
+            skipped_types[msg.getDataType()]++;
+            continue;
+        }
+        pcl::fromROSMsg(*scan_msg, scan);
+        for (const PointI &pt : scan.points) {
+            /** livox reports the missing returns at the origin **/
+            if (!pcl::isFinite(pt) || pt.getVector3fMap().squaredNorm() < 1e-6) {
+                continue;
+            }
+            Voxel &voxel = voxels[voxelKey(pt.x, pt.y, pt.z, this->kVoxelSize)];
+            voxel.x += pt.x;
+            voxel.y += pt.y;
+            voxel.z += pt.z;
+            voxel.intensity += pt.intensity;
+            voxel.num++;
+        }
+        num_scan_points += scan.size();
+        num_msgs++;
+    }
+    bag.close();
+    for (const auto &item : skipped_types) {
+        ROS_WARN("Skipped %d messages of type %s on %s, only sensor_msgs/PointCloud2 is accumulated.",
+                 item.second, item.first.c_str(), this->TOPIC_NAME.c_str());
+    }
+    if (voxels.empty()) {
+        ROS_ERROR("No points accumulated from topic %s of %s.", this->TOPIC_NAME.c_str(), this->cocalibBagPath.c_str());
+        return false;
+    }
+
+    CloudI cloud;
+    cloud.points.reserve(voxels.size());
+    for (const auto &item : voxels) {
+        const Voxel &voxel = item.second;
+        PointI pt;
+        pt.x = voxel.x / voxel.num;
+        pt.y = voxel.y / voxel.num;
+        pt.z = voxel.z / voxel.num;
+        pt.intensity = voxel.intensity / voxel.num;
+        cloud.points.push_back(pt);
+    }
+    cloud.width = cloud.points.size();
+    cloud.height = 1;
+    if (MESSAGE_EN) {
+        ROS_INFO("Accumulated %d messages, %ld points into %ld voxels.", num_msgs, num_scan_points, cloud.points.size());
+    }
+    pcl::io::savePCDFileBinary(this->cocalibCloudPath, cloud);
+    return true;
+}
+
 void LidarProcess::cartToSphere() {
     cout << "----- LiDAR: CartToSphere -----" << endl;
     float theta_min = M_PI, theta_max = -M_PI;
     pcl::io::loadPCDFile(this->cocalibCloudPath, *this->lidarCartCloud);
-    pcl::copyPointCloud(*this->lidarCartCloud, *this->lidarPolarCloud);
-    for (auto &point : this->lidarPolarCloud->points) {
-        float radius = point.getVector3fMap().norm();
-        float phi = atan2(point.y, point.x);
-        float theta = acos(point.z / radius);
-        point.x = theta;
-        point.y = phi;
-        point.z = radius;
-        if (theta > theta_max) { theta_max = theta;}
-        else if (theta < theta_min) { theta_min = theta;}
+    /** the polar coordinates are kept beside the cartesian cloud instead of in a second copy of it **/
+    const int num_points = this->lidarCartCloud->points.size();
+    PolarPoints &polar = this->lidarPolarPoints;
+    polar.resize(num_points);
+    #pragma omp parallel num_threads(THREADS) reduction(min:theta_min) reduction(max:theta_max)
+    {
+        /** each thread converts one contiguous chunk with the vectorized kernel **/
+        const int num_threads = omp_get_num_threads();
+        const int chunk = (num_points + num_threads - 1) / num_threads;
+        const int begin = min(num_points, omp_get_thread_num() * chunk);
+        const int end = min(num_points, begin + chunk);
+        if (end > begin) {
+            polar_kernel::cartToSphere(&this->lidarCartCloud->points[begin].x, sizeof(PointI) / sizeof(float), end - begin,
+                                       &polar.theta[begin], &polar.phi[begin], &polar.range[begin],
+                                       theta_min, theta_max);
+        }
+        for (int i = begin; i < end; ++i) {
+            polar.intensity[i] = this->lidarCartCloud->points[i].intensity;
+            polar.index[i] = i;
+        }
     }
     if (MESSAGE_EN) {
         ROS_INFO("Polar cloud generated. \ntheta: (min, max) = (%f, %f)", theta_min, theta_max);
     }
-    pcl::io::savePCDFileBinary(this->COCALIB_PATH + "/lidar_polar_cloud.pcd", *this->lidarPolarCloud);
+    if (EXTRA_FILE_EN) {
+        CloudI polar_cloud;
+        polar_cloud.points.resize(num_points);
+        for (int i = 0; i < num_points; ++i) {
+            polar_cloud.points[i].x = polar.theta[i];
+            polar_cloud.points[i].y = polar.phi[i];
+            polar_cloud.points[i].z = polar.range[i];
+            polar_cloud.points[i].intensity = polar.intensity[i];
+        }
+        polar_cloud.width = num_points;
+        polar_cloud.height = 1;
+        pcl::io::savePCDFileBinary(this->COCALIB_PATH + "/lidar_polar_cloud.pcd", polar_cloud);
+    }
 }
 
-void LidarProcess::sphereToPlane() {
+void LidarProcess::sphereToPlane(int level) {
     cout << "----- LiDAR: SphereToPlane -----" << endl;
+    /** pyramid level l bins the points into pixels 2^l times larger **/
+    const int rows = this->kFlatImageSize.first >> level;
+    const int cols = this->kFlatImageSize.second >> level;
+    const float kRadPerPix = this->kRadPerPix * (1 << level);
+    const PolarPoints &polar = this->lidarPolarPoints;
+    const int num_points = polar.size();
     /** define the data container **/
-    cv::Mat flat_img = cv::Mat::zeros(this->kFlatImageSize.first, this->kFlatImageSize.second, CV_8U);
-    vector<vector<Tags>> tags_map (this->kFlatImageSize.first, vector<Tags>(this->kFlatImageSize.second));
-    /** construct kdtrees and load the point clouds **/
-    /** caution: the point cloud need to be set before the loop **/
-    pcl::KdTreeFLANN<PointI> kdtree;
-    CloudI::Ptr polar_flat_cloud(new CloudI);
-    pcl::copyPointCloud(*this->lidarPolarCloud, *polar_flat_cloud);
-    for (auto &pt : polar_flat_cloud->points) {pt.z = 0;}
-    kdtree.setInputCloud(polar_flat_cloud);
-
-    /** define the invalid search parameters **/
-    int invalid_search_num, valid_search_num = 0; /** search invalid count **/
-    int invalid_idx_num = 0; /** index invalid count **/
+    cv::Mat flat_img = cv::Mat::zeros(rows, cols, CV_8U);
+    TagsMap &tags_map = this->tagsMap;
+    tags_map.rows = rows;
+    tags_map.cols = cols;
+    tags_map.offsets.assign(rows * cols + 1, 0);
+
+    /** define the search parameters **/
     const float kSearchRadius = sqrt(2) * (kRadPerPix / 2);
-    const float sensitivity = 0.02f;
+    const float sensitivity = 0.02f; /** depth tolerance relative to the front surface **/
+
+    /** a pixel collects every point within kSearchRadius of its (theta, phi) center, **/
+    /** so each point falls into its own pixel and possibly into the 8 pixels around it **/
+    auto binPoint = [&](int idx, int *bins) {
+        int num_bins = 0;
+        const float theta = polar.theta[idx];
+        const float phi = polar.phi[idx];
+        if (!std::isfinite(theta) || !std::isfinite(phi)) {
+            return num_bins;
+        }
+        const int u_pt = floor((M_PI - theta) / kRadPerPix);
+        const int v_pt = floor((phi + M_PI) / kRadPerPix);
+        for (int u = max(u_pt - 1, 0); u <= min(u_pt + 1, rows - 1); ++u) {
+            float theta_center = - kRadPerPix * (2 * u + 1) / 2 + M_PI;
+            for (int v = max(v_pt - 1, 0); v <= min(v_pt + 1, cols - 1); ++v) {
+                float phi_center = kRadPerPix * (2 * v + 1) / 2 - M_PI;
+                float d_theta = theta - theta_center;
+                float d_phi = phi - phi_center;
+                if (d_theta * d_theta + d_phi * d_phi <= kSearchRadius * kSearchRadius) {
+                    bins[num_bins++] = u * cols + v;
+                }
+            }
+        }
+        return num_bins;
+    };
+
+    /** z-buffer: nearest range of each pixel, packed over the point index so that **/
+    /** the atomic min on the packed value is deterministic under any thread schedule **/
+    const uint64_t kEmpty = std::numeric_limits<uint64_t>::max();
+    vector<std::atomic<uint64_t>> depth_map(rows * cols);
+    #pragma omp parallel for num_threads(THREADS)
+    for (int p = 0; p < rows * cols; ++p) {
+        depth_map[p].store(kEmpty, std::memory_order_relaxed);
+    }
+    #pragma omp parallel for num_threads(THREADS)
+    for (int i = 0; i < num_points; ++i) {
+        if (!(polar.range[i] > 0)) {
+            continue;
+        }
+        uint32_t range_bits;
+        memcpy(&range_bits, &polar.range[i], sizeof(range_bits)); /** positive floats order like their bits **/
+        const uint64_t packed = (uint64_t(range_bits) << 32) | uint32_t(i);
+        int bins[9];
+        int num_bins = binPoint(i, bins);
+        for (int k = 0; k < num_bins; ++k) {
+            std::atomic<uint64_t> &depth = depth_map[bins[k]];
+            uint64_t front = depth.load(std::memory_order_relaxed);
+            while (packed < front && !depth.compare_exchange_weak(front, packed, std::memory_order_relaxed)) {}
+        }
+    }
+    /** a point is visible in a pixel if it lies within the tolerance behind the front surface **/
+    auto isVisible = [&](int idx, int bin) {
+        const uint32_t front_bits = depth_map[bin].load(std::memory_order_relaxed) >> 32;
+        float front_range;
+        memcpy(&front_range, &front_bits, sizeof(front_range));
+        return polar.range[idx] <= front_range * (1 + sensitivity);
+    };
 
+    /** scatter the visible points into the tags: count, prefix sum, fill **/
     #pragma omp parallel for num_threads(THREADS)
-    for (int u = 0; u < this->kFlatImageSize.first; ++u) {
-        float theta_center = - kRadPerPix * (2 * u + 1) / 2 + M_PI;
-        for (int v = 0; v < this->kFlatImageSize.second; ++v) {
-            float phi_center = kRadPerPix * (2 * v + 1) / 2 - M_PI;
-            /** assign the theta and phi center to the search_center **/
-            PointI search_center;
-            search_center.x = theta_center;
-            search_center.y = phi_center;
-            search_center.z = 0;
-            vector<int> tag;
-            /** define the vector container for storing the info of searched points **/
-            vector<int> search_pt_idx_vec;
-            vector<float> search_pt_squared_dis_vec; /** type of distance vector has to be float **/
-            /** use kdtree to search (radius search) the spherical point cloud **/
-            int search_num = kdtree.radiusSearch(search_center, kSearchRadius, search_pt_idx_vec, search_pt_squared_dis_vec); // number of the radius nearest neighbors
-            if (search_num == 0) {
-                flat_img.at<uint8_t>(u, v) = 0; /** intensity **/
-                invalid_search_num ++;
+    for (int i = 0; i < num_points; ++i) {
+        if (!(polar.range[i] > 0)) {
+            continue;
+        }
+        int bins[9];
+        int num_bins = binPoint(i, bins);
+        for (int k = 0; k < num_bins; ++k) {
+            if (isVisible(i, bins[k])) {
+                #pragma omp atomic
+                tags_map.offsets[bins[k] + 1]++;
             }
-            else { /** corresponding points are found in the radius neighborhood **/
-                int hidden_pt_num = 0;
-                float dist_mean = 0;
-                float intensity_mean = 0;
-                vector<int> local_vec(search_num, 0);
-                for (int i = 0; i < search_num; ++i) {
-                    dist_mean += this->lidarPolarCloud->points[search_pt_idx_vec[i]].z;
-                }
-                dist_mean = dist_mean / search_num;
-                for (int i = 0; i < search_num; ++i) {
-                    PointI &local_pt = this->lidarPolarCloud->points[search_pt_idx_vec[i]];
-                    float dist = local_pt.z;
-                    if ((abs(dist_mean - dist) > dist * sensitivity) || ((dist_mean - dist) > dist * sensitivity && local_pt.intensity < 20)) {
-                        hidden_pt_num++;
-                    }
-                    else {
-                        intensity_mean += local_pt.intensity;
-                        local_vec[i] = search_pt_idx_vec[i];
-                    }
-                }
-                /** add tags **/
-                local_vec.erase(std::remove(local_vec.begin(), local_vec.end(), 0), local_vec.end());
-                tag.insert(tag.begin(), local_vec.data(), local_vec.data()+local_vec.size());
-                if (tag.size() > 0) {
-                    intensity_mean /= tag.size();
-                }                
-                flat_img.at<uchar>(u, v) = static_cast<uchar>(intensity_mean);
+        }
+    }
+    std::partial_sum(tags_map.offsets.begin(), tags_map.offsets.end(), tags_map.offsets.begin());
+    tags_map.indices.resize(tags_map.offsets.back());
+    vector<int> tag_cursor(tags_map.offsets.begin(), tags_map.offsets.end() - 1);
+    #pragma omp parallel for num_threads(THREADS)
+    for (int i = 0; i < num_points; ++i) {
+        if (!(polar.range[i] > 0)) {
+            continue;
+        }
+        int bins[9];
+        int num_bins = binPoint(i, bins);
+        for (int k = 0; k < num_bins; ++k) {
+            if (isVisible(i, bins[k])) {
+                int slot;
+                #pragma omp atomic capture
+                slot = tag_cursor[bins[k]]++;
+                tags_map.indices[slot] = i;
+            }
+        }
+    }
+
+    /** intensity of the front surface, tags converted to indices of the cartesian cloud **/
+    #pragma omp parallel for num_threads(THREADS)
+    for (int u = 0; u < rows; ++u) {
+        for (int v = 0; v < cols; ++v) {
+            int *tag_begin = tags_map.indices.data() + tags_map.offsets[u * cols + v];
+            int *tag_end = tags_map.indices.data() + tags_map.offsets[u * cols + v + 1];
+            if (tag_begin == tag_end) {
+                continue;
+            }
+            /** the fill order depends on the thread schedule, sort to keep the tags deterministic **/
+            std::sort(tag_begin, tag_end);
+            float intensity_mean = 0;
+            for (int *tag = tag_begin; tag != tag_end; ++tag) {
+                intensity_mean += polar.intensity[*tag];
+                *tag = polar.index[*tag];
             }
-            tags_map[u][v] = tag;
+            intensity_mean /= (tag_end - tag_begin);
+            flat_img.at<uchar>(u, v) = static_cast<uchar>(intensity_mean);
         }
     }
-    this->tagsMap = tags_map;
-    cv::imwrite(this->flatImagePath, flat_img);
+    this->flatImage = flat_img;
+    if (this->kSaveEdgeImages) {
+        cv::imwrite(this->flatImagePath, flat_img);
+    }
 }
 
 // void LidarProcess::cartToSphere() {
@@ -218,40 +390,195 @@ void LidarProcess::sphereToPlane() {
 //     cv::imwrite(this->flatImagePath, flat_img);
 // }
 
-void LidarProcess::edgeExtraction() {
-    cout << "----- LiDAR: PythonScript EdgeExtraction -----" << endl;
-    string mode = "lidar";
-    string cmd_str = "python3 " + this->PYSCRIPT_PATH + " " + this->DATASET_PATH + " " + mode;
-    int status = system(cmd_str.c_str());
+void LidarProcess::edgeExtraction(int level) {
+    cout << "----- LiDAR: EdgeExtraction -----" << endl;
+    /** same chain as edge_extraction.py, run in process on the flat image of sphereToPlane **/
+    /** pyramid level l has pixels 2^l times larger, the spatial radius and the contour length shrink by 2^l, **/
+    /** a pixel bins 4^l times the points, so its noise and the denoising strength shrink by 2^l as well **/
+    const double kLevelScale = 1.0 / (1 << level);
+    const int kMeanShiftLevel = 1; /** default maxLevel of pyrMeanShiftFiltering **/
+    const int kMeanShiftIter = 5; /** default max iterations of pyrMeanShiftFiltering **/
+    const int kAlign = 1 << (kMeanShiftLevel + 1);
+    auto spatial_radius = [&](int sp) {
+        return std::max(1, (int)lround(sp * kLevelScale));
+    };
+    /** rows a filtered pixel depends on: on pyramid level l the mean shift moves by at most kMeanShiftIter sp **/
+    /** and reads sp around its end, pyrDown / pyrUp read 2 pixels, 2^l full pixels each, **/
+    /** non-local means reads half of its search and template windows **/
+    auto halo = [&](int sp) {
+        const int level_span = (1 << (kMeanShiftLevel + 1)) - 1;
+        return (kMeanShiftIter + 1) * sp * level_span + 2 * level_span + 21 / 2 + 7 / 2 + kAlign;
+    };
+    const cv::Mat &flat_img = this->flatImage;
+
+    /** mean shift + non-local means, the lower part of the image (ground) is smoothed stronger **/
+    /** tiles > 1: each part runs on parallel bands of at least 2 halos, padded by the halo **/
+    auto blur = [&](const cv::Mat &src, int h_u, int h_l, int tiles) {
+        cv::Mat src_bgr, dst_u, dst_l, dst;
+        cv::cvtColor(src, src_bgr, cv::COLOR_GRAY2BGR);
+        const int split = int(0.85 * src.rows);
+        /** the color radius 2 sp stays at its full resolution value **/
+        auto filter = [&](const cv::Mat &tile, cv::Mat &out, int sp, int h) {
+            cv::Mat shifted;
+            cv::pyrMeanShiftFiltering(tile, shifted, spatial_radius(sp), 2 * sp, kMeanShiftLevel);
+            cv::cvtColor(shifted, shifted, cv::COLOR_BGR2GRAY);
+            cv::fastNlMeansDenoising(shifted, out, float(h * kLevelScale), 7, 21);
+        };
+        auto part = [&](const cv::Mat &part_src, cv::Mat &part_dst, int sp, int h) {
+            const int part_halo = halo(spatial_radius(sp));
+            const int part_tiles = std::max(1, std::min(tiles, part_src.rows / (2 * part_halo)));
+            if (part_tiles > 1) {
+                tiledFilter(part_src, part_dst, CV_8U, part_tiles, part_halo,
+                            [&](const cv::Mat &tile, cv::Mat &out) { filter(tile, out, sp, h); }, kAlign);
+            }
+            else {
+                filter(part_src, part_dst, sp, h);
+            }
+        };
+        part(src_bgr.rowRange(0, split), dst_u, h_u, h_l);
+        part(src_bgr.rowRange(split, src.rows), dst_l, h_l, h_l);
+        cv::vconcat(dst_u, dst_l, dst);
+        return dst;
+    };
+    cv::Mat edge_img = blur(flat_img, 10, 20, this->kEdgeTiles);
+    /** the blur is the only tiled step, identical blurred images give identical edge maps **/
+    if (this->kEdgeTiles > 1 && this->kEdgeTileCheck) {
+        const cv::Mat untiled_img = blur(flat_img, 10, 20, 1);
+        const int num_diff = cv::countNonZero(edge_img != untiled_img);
+        if (num_diff > 0) {
+            ROS_WARN("Tiled lidar edge extraction differs from the untiled one in %d pixels at level %d.", num_diff, level);
+        }
+        else {
+            ROS_INFO("Tiled lidar edge extraction matches the untiled one at level %d.", level);
+        }
+    }
+    if (this->kSaveEdgeImages) {
+        cv::imwrite(this->EDGE_PATH + "/lidar_1_filtered.bmp", edge_img);
+    }
+
+    /** mask to remove the upper and lower bound noise **/
+    cv::Canny(edge_img, edge_img, 25, 50);
+    cv::Mat mask = cv::imread(this->lidarMaskPath, cv::IMREAD_GRAYSCALE);
+    if (mask.size() != edge_img.size()) {
+        /** coarse pyramid levels of the flat image **/
+        cv::resize(mask, mask, edge_img.size(), 0, 0, cv::INTER_NEAREST);
+    }
+    cv::bitwise_and(edge_img, mask, edge_img);
+    if (this->kSaveEdgeImages) {
+        cv::Mat canny_img;
+        cv::bitwise_or(flat_img, edge_img, canny_img);
+        cv::imwrite(this->EDGE_PATH + "/lidar_2_canny.bmp", canny_img);
+    }
+
+    /** contour filter **/
+    this->edgeImage = contourFilter(edge_img, std::max(1, (int)lround(150 * kLevelScale)));
+    if (this->kSaveEdgeImages) {
+        cv::imwrite(this->lidarEdgeImagePath, this->edgeImage);
+    }
 }
 
-void LidarProcess::generateEdgeCloud() {
+bool LidarProcess::generateEdgeCloud(int level) {
     cout << "----- LiDAR: GenerateEdgeCloud -----" << endl;
-    cv::Mat edge_img = cv::imread(this->lidarEdgeImagePath, cv::IMREAD_UNCHANGED);
-    ROS_ASSERT_MSG((edge_img.rows != 0 && edge_img.cols != 0), "size of original fisheye image is 0, check the path and filename! \nPath: %s", edge_img_path.c_str());
-    ROS_ASSERT_MSG((edge_img.rows == this->kFlatImageSize.first || edge_img.cols == kFlatImageSize.second), "size of original fisheye image is incorrect!");
+    const cv::Mat &edge_img = this->edgeImage;
+    /** ROS_ASSERT is compiled out in release builds, the tags map would be indexed out of bounds **/
+    if (edge_img.rows == 0 || edge_img.cols == 0) {
+        ROS_ERROR("Size of lidar edge image is 0, run edgeExtraction first!");
+        return false;
+    }
+    if (edge_img.rows != this->tagsMap.rows || edge_img.cols != this->tagsMap.cols) {
+        ROS_ERROR("Size of lidar edge image %d x %d does not match the tags map %d x %d of pyramid level %d!",
+                  edge_img.rows, edge_img.cols, this->tagsMap.rows, this->tagsMap.cols, level);
+        return false;
+    }
+
+    /** uniform sampling, coarser levels have wider edges and are sampled sparser **/
+    /** same rule as pcl::UniformSampling: each voxel keeps the point nearest to its center **/
+    const float kSampleSize = 0.005 * (1 << level);
+    struct Sample {
+        int index;
+        float dist;
+    };
+    auto keepNearest = [](unordered_map<uint64_t, Sample> &samples, uint64_t key, const Sample &sample) {
+        auto item = samples.emplace(key, sample);
+        Sample &kept = item.first->second;
+        /** ties go to the lower index, so the result does not depend on the thread schedule **/
+        if (!item.second && (sample.dist < kept.dist || (sample.dist == kept.dist && sample.index < kept.index))) {
+            kept = sample;
+        }
+    };
 
-    CloudI::Ptr edge_xyzi (new CloudI);
+    /** gather and sample in one pass, each thread owns its voxel buffer **/
+    vector<unordered_map<uint64_t, Sample>> thread_samples(THREADS);
+    #pragma omp parallel for num_threads(THREADS) schedule(dynamic, 16)
     for (int u = 0; u < edge_img.rows; ++u) {
+        unordered_map<uint64_t, Sample> &samples = thread_samples[omp_get_thread_num()];
+        const uchar *edge_row = edge_img.ptr<uchar>(u);
         for (int v = 0; v < edge_img.cols; ++v) {
-            if (edge_img.at<uchar>(u, v) > 127) {
-                Tags &tag = this->tagsMap[u][v];
-                for (int i = 0; i < tag.size(); ++i) { 
-                    PointI &pixel_pt = this->lidarCartCloud->points[tag[i]];
-                    edge_xyzi->points.push_back(pixel_pt);
+            if (edge_row[v] > 127) {
+                for (const int *tag = this->tagsMap.begin(u, v); tag != this->tagsMap.end(u, v); ++tag) {
+                    const PointI &pt = this->lidarCartCloud->points[*tag];
+                    const float dx = pt.x - (floor(pt.x / kSampleSize) + 0.5f) * kSampleSize;
+                    const float dy = pt.y - (floor(pt.y / kSampleSize) + 0.5f) * kSampleSize;
+                    const float dz = pt.z - (floor(pt.z / kSampleSize) + 0.5f) * kSampleSize;
+                    keepNearest(samples, voxelKey(pt.x, pt.y, pt.z, kSampleSize), {*tag, dx * dx + dy * dy + dz * dz});
                 }
             }
         }
     }
+    for (int t = 1; t < THREADS; ++t) {
+        for (const auto &item : thread_samples[t]) {
+            keepNearest(thread_samples[0], item.first, item.second);
+        }
+        unordered_map<uint64_t, Sample>().swap(thread_samples[t]);
+    }
+    vector<int> sample_indices;
+    sample_indices.reserve(thread_samples[0].size());
+    for (const auto &item : thread_samples[0]) {
+        sample_indices.push_back(item.second.index);
+    }
+    sort(sample_indices.begin(), sample_indices.end());
+
+    /** write the samples into the pyramid level directly **/
+    this->lidarEdgeCloud = this->lidarEdgePyramid[level];
+    EdgeCloud &edge_cloud = *this->lidarEdgeCloud;
+    edge_cloud.points.resize(sample_indices.size());
+    #pragma omp parallel for num_threads(THREADS)
+    for (int i = 0; i < (int)sample_indices.size(); ++i) {
+        const PointI &pt = this->lidarCartCloud->points[sample_indices[i]];
+        edge_cloud.points[i].x = pt.x;
+        edge_cloud.points[i].y = pt.y;
+        edge_cloud.points[i].z = pt.z;
+    }
+    edge_cloud.width = edge_cloud.points.size();
+    edge_cloud.height = 1;
+    edge_cloud.is_dense = true;
+    if (MESSAGE_EN) {
+        ROS_INFO("LiDAR edge cloud level %d: %d points after %.1f mm sampling.", level, (int)edge_cloud.size(), kSampleSize * 1000);
+    }
+
+    string edge_cloud_path = this->lidarEdgeCloudPath;
+    if (level > 0) {
+        edge_cloud_path.insert(edge_cloud_path.rfind('.'), "_" + to_string(level));
+    }
+    pcl::io::savePCDFileBinary(edge_cloud_path, *this->lidarEdgeCloud);
+    return true;
+}
 
-    /** uniform sampling **/
-    pcl::UniformSampling<PointI> us;
-    us.setRadiusSearch(0.005);
-    us.setInputCloud(edge_xyzi);
-    us.filter(*edge_xyzi);
+int LidarProcess::pyramidLevel(double bandwidth) {
+    /** flat pixels and fisheye pixels cover similar angles, keep the pixel of a level within a quarter of the bandwidth **/
+    int level = 0;
+    while (level + 1 < this->kPyramidLevels && (1 << (level + 1)) * 4 <= bandwidth) {
+        ++level;
+    }
+    return level;
+}
 
-    pcl::copyPointCloud(*edge_xyzi, *this->lidarEdgeCloud);
-    pcl::io::savePCDFileBinary(this->lidarEdgeCloudPath, *this->lidarEdgeCloud);
+void LidarProcess::selectPyramidLevel(double bandwidth) {
+    int level = pyramidLevel(bandwidth);
+    this->lidarEdgeCloud = this->lidarEdgePyramid[level];
+    if (MESSAGE_EN) {
+        ROS_INFO("Bandwidth %f uses edge cloud level %d with %ld points.", bandwidth, level, this->lidarEdgeCloud->size());
+    }
 }
 
 double LidarProcess::getEdgeDistance(EdgeCloud::Ptr cloud_tgt, EdgeCloud::Ptr cloud_src, float max_range) {
@@ -1,3 +1,8 @@
+/** basic **/
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 /** headings **/
 #include <omni_process.h>
 #include <common_lib.h>
@@ -6,32 +11,37 @@
 /** namespace **/
 using namespace std;
 using namespace cv;
-using namespace mlpack::kde;
-using namespace mlpack::metric;
-using namespace mlpack::tree;
-using namespace mlpack::kernel;
-using namespace arma;
 
-OmniProcess::OmniProcess() {
+OmniProcess::OmniProcess(int spot) {
     /** Param **/
     ros::param::get("essential/kDatasetName", this->DATASET_NAME);
     ros::param::get("essential/kNumSpot", this->NUM_SPOT);
     ros::param::get("essential/kImageRows", this->kImageSize.first);
     ros::param::get("essential/kImageCols", this->kImageSize.second);
+    ros::param::get("essential/kEdgeTiles", this->kEdgeTiles);
+    ros::param::get("essential/kKdeFftBandwidth", this->kKdeFftBandwidth);
+    ros::param::get("essential/kKdeCoarseBandwidth", this->kKdeCoarseBandwidth);
+    ros::param::get("switch/kSaveEdgeImages", this->kSaveEdgeImages);
+    ros::param::get("switch/kKdeCache", this->kKdeCache);
+    ros::param::get("switch/kKdeGradient", this->kKdeGradient);
+    ros::param::get("switch/kDistanceField", this->kDistanceField);
+    ros::param::get("switch/kKdeAnnulus", this->kKdeAnnulus);
+    ros::param::get("essential/kKdeMargin", this->kKdeMargin);
 
     this->ocamEdgeCloud.reset(new pcl::PointCloud<pcl::PointXYZ>);
     /** Path **/
     this->PKG_PATH = ros::package::getPath("cocalibration");
     this->DATASET_PATH = this->PKG_PATH + "/data/" + this->DATASET_NAME;
-    this->COCALIB_PATH = this->DATASET_PATH + "/cocalibration";
+    /** spot s of a multi spot dataset lives in cocalibration/spot<s> **/
+    this->COCALIB_PATH = this->DATASET_PATH + "/cocalibration" + ((spot < 0) ? "" : "/spot" + to_string(spot));
     this->EDGE_PATH = this->COCALIB_PATH + "/edges";
     this->RESULT_PATH = this->COCALIB_PATH + "/results";
-    this->PYSCRIPT_PATH = this->PKG_PATH + "/python_scripts/image_process/edge_extraction.py";
 
+    this->omniMaskPath = this->PKG_PATH + "/python_scripts/image_process/omni_image_mask.png";
     this->cocalibImagePath = this->COCALIB_PATH + "/hdr_image.bmp";
     this->cocalibEdgeImagePath = this->EDGE_PATH + "/omni_edge_image.bmp";
     this->cocalibEdgeCloudPath = this->EDGE_PATH + "/edge_cloud.pcd";
-    this->cocalibKdePath = RESULT_PATH + "/kde_samples.txt";
+    this->kdeCachePath = this->COCALIB_PATH + "/kde_cache";
 }
 
 void OmniProcess::loadCocalibImage() {
@@ -43,16 +53,52 @@ void OmniProcess::loadCocalibImage() {
 }
 
 void OmniProcess::edgeExtraction() {
-    ROS_INFO("Run pythonscripts, Extract ocam edges");
-    string mode = "omni";
-    string cmd_str = "python3 " + this->PYSCRIPT_PATH + " " + this->DATASET_PATH + " " + mode;
-    int status = system(cmd_str.c_str());
+    ROS_INFO("Extract ocam edges");
+    /** same chain as edge_extraction.py, run in process on the loaded cocalibration image **/
+    const int kHalo = 16; /** gaussian and sobel support, canny hysteresis is only followed this far across a seam **/
+    cv::Mat gray_img;
+    if (this->cocalibImage.channels() == 3) {
+        cv::cvtColor(this->cocalibImage, gray_img, cv::COLOR_BGR2GRAY);
+    }
+    else {
+        gray_img = this->cocalibImage;
+    }
+
+    cv::Mat filtered_img, edge_img;
+    auto filter = [](const cv::Mat &src, cv::Mat &dst) {
+        cv::GaussianBlur(src, dst, cv::Size(5, 5), 1, 1);
+    };
+    auto canny = [](const cv::Mat &src, cv::Mat &dst) {
+        cv::Canny(src, dst, 25, 50);
+    };
+    if (this->kEdgeTiles > 1) {
+        tiledFilter(gray_img, filtered_img, CV_8U, this->kEdgeTiles, kHalo, filter);
+        tiledFilter(filtered_img, edge_img, CV_8U, this->kEdgeTiles, kHalo, canny);
+    }
+    else {
+        filter(gray_img, filtered_img);
+        canny(filtered_img, edge_img);
+    }
+
+    /** remove the black region **/
+    cv::Mat mask = cv::imread(this->omniMaskPath, cv::IMREAD_GRAYSCALE);
+    cv::bitwise_and(edge_img, mask, edge_img);
+
+    /** contour filter **/
+    this->edgeImage = contourFilter(edge_img, 150);
+
+    if (this->kSaveEdgeImages) {
+        cv::Mat canny_img;
+        cv::bitwise_or(gray_img, edge_img, canny_img);
+        cv::imwrite(this->EDGE_PATH + "/omni_1_filtered.bmp", filtered_img);
+        cv::imwrite(this->EDGE_PATH + "/omni_2_canny.bmp", canny_img);
+        cv::imwrite(this->cocalibEdgeImagePath, this->edgeImage);
+    }
 }
 
 void OmniProcess::generateEdgeCloud() {
-    cv::Mat edge_img = cv::imread(this->cocalibEdgeImagePath, cv::IMREAD_UNCHANGED);
-    ROS_ASSERT_MSG((image.rows != 0 || image.cols != 0),
-                   "Invalid size (%d, %d) from file: %s", image.rows, image.cols, edge_img_path);
+    const cv::Mat &edge_img = this->edgeImage;
+    ROS_ASSERT_MSG((edge_img.rows != 0 && edge_img.cols != 0), "size of omni edge image is 0, run edgeExtraction first!");
     for (int u = 0; u < edge_img.rows; ++u) {
         for (int v = 0; v < edge_img.cols; ++v) {
             if (edge_img.at<uchar>(u, v) > 127) {
@@ -66,59 +112,466 @@ void OmniProcess::generateEdgeCloud() {
     }
 }
 
-vector<double> OmniProcess::Kde(double bandwidth, double scale) {
-    clock_t start_time = clock();
-    const double default_rel_error = 0.05;
-    const int n_rows = scale * this->kImageSize.first;
-    const int n_cols = scale * this->kImageSize.second;
-    arma::mat query;
-    // number of rows equal to number of dimensions, query.n_rows == reference.n_rows is required
+/** bandwidths above kKdeCoarseBandwidth are smooth enough to be sampled sparser **/
+double OmniProcess::kdeScale(double bandwidth) {
+    double scale = KDE_SCALE;
+    if (this->kKdeCoarseBandwidth > 0 && bandwidth > this->kKdeCoarseBandwidth) {
+        scale *= this->kKdeCoarseBandwidth / bandwidth;
+    }
+    return scale;
+}
+
+/** Epanechnikov KDE of the edge pixels, normalized as mlpack: sum(max(0, 1 - d^2 / h^2)) / (N * pi * h^2 / 2) **/
+/** the edge pixels sit on the pixel lattice, so the estimate is the convolution of the edge mask with the kernel **/
+/** all bandwidths share the sorted edge rows and the spectrum of the edge mask **/
+/** with kDistanceField all bandwidths share one distance transform of the edge mask instead **/
+void OmniProcess::kdePyramid(const vector<double> &bandwidths) {
+    auto start_time = chrono::steady_clock::now();
     const int ref_size = this->ocamEdgeCloud->size();
-    arma::mat reference(2, ref_size);
-    for (int i = 0; i < ref_size; ++i) {
-        reference(0, i) = this->ocamEdgeCloud->points[i].x;
-        reference(1, i) = this->ocamEdgeCloud->points[i].y;
+    ROS_ASSERT_MSG((ref_size > 0), "omni edge cloud is empty, run generateEdgeCloud first!");
+
+    vector<KdeField *> direct_fields, fft_fields, edt_fields;
+    double max_fft_bandwidth = 0;
+    int num_cached = 0;
+    if (this->kKdeCache) {
+        CheckFolder(this->kdeCachePath);
+    }
+    for (double bandwidth : bandwidths) {
+        if (this->kdeFields.count(bandwidth)) {
+            continue;
+        }
+        const double scale = kdeScale(bandwidth);
+        this->kdeFields[bandwidth].reset(new KdeField(bandwidth, scale, scale * this->kImageSize.first, scale * this->kImageSize.second));
+        KdeField &field = *this->kdeFields[bandwidth];
+        if (this->kKdeCache && loadKdeCache(field)) {
+            ++num_cached;
+            continue;
+        }
+        field.allocate();
+        /** the DFT only pays off for wide kernels on the full pixel lattice **/
+        if (this->kDistanceField) {
+            edt_fields.push_back(&field);
+        }
+        else if (field.scale == 1 && bandwidth >= this->kKdeFftBandwidth) {
+            fft_fields.push_back(&field);
+            max_fft_bandwidth = max(max_fft_bandwidth, bandwidth);
+        }
+        else {
+            direct_fields.push_back(&field);
+        }
+    }
+
+    if (!direct_fields.empty()) {
+        KdeEdgeRows edge_rows = kdeEdgeRows();
+        for (KdeField *field : direct_fields) {
+            kdeDirect(edge_rows, *field);
+        }
+    }
+    if (!fft_fields.empty()) {
+        /** pad by the widest kernel so that the circular convolution does not wrap **/
+        const int kRadius = ceil(max_fft_bandwidth);
+        const cv::Size kDftSize(cv::getOptimalDFTSize(this->kImageSize.second + kRadius),
+                                cv::getOptimalDFTSize(this->kImageSize.first + kRadius));
+        cv::Mat mask_spectrum = cv::Mat::zeros(kDftSize, CV_64F);
+        for (const auto &pt : this->ocamEdgeCloud->points) {
+            mask_spectrum.at<double>((int)pt.x, (int)pt.y) += 1;
+        }
+        cv::dft(mask_spectrum, mask_spectrum, 0, this->kImageSize.first);
+        #pragma omp parallel for num_threads(min(THREADS, (int)fft_fields.size())) schedule(dynamic, 1)
+        for (int k = 0; k < (int)fft_fields.size(); ++k) {
+            kdeFft(mask_spectrum, *fft_fields[k]);
+        }
+    }
+
+    if (!edt_fields.empty()) {
+        vector<float> edge_dist = edgeDistance();
+        for (KdeField *field : edt_fields) {
+            distanceField(edge_dist, *field);
+        }
     }
 
-    query = arma::mat(2, n_cols * n_rows);
-    arma::vec rows = arma::linspace(0, this->kImageSize.first - 1, n_rows);
-    arma::vec cols = arma::linspace(0, this->kImageSize.second - 1, n_cols);
+    for (KdeField *field : direct_fields) {
+        field->build();
+    }
+    for (KdeField *field : edt_fields) {
+        field->build();
+    }
+    for (KdeField *field : fft_fields) {
+        field->build();
+    }
 
-    for (int i = 0; i < n_rows; ++i) {
-        for (int j = 0; j < n_cols; ++j) {
-            query(0, i * n_cols + j) = rows.at(i);
-            query(1, i * n_cols + j) = cols.at(j);
+    if (this->kKdeGradient) {
+        for (const auto &item : this->kdeFields) {
+            if (!item.second->hasGradient()) {
+                item.second->buildGradient();
+            }
+        }
+    }
+    if (this->kKdeCache) {
+        for (KdeField *field : direct_fields) {
+            saveKdeCache(*field);
+        }
+        for (KdeField *field : fft_fields) {
+            saveKdeCache(*field);
+        }
+        for (KdeField *field : edt_fields) {
+            saveKdeCache(*field);
         }
     }
+    if (MESSAGE_EN) {
+        double time = chrono::duration<double>(chrono::steady_clock::now() - start_time).count();
+        ROS_INFO("%d cost fields generated in %f s, %d direct, %d dft, %d edt, %d cached.",
+                 (int)(direct_fields.size() + fft_fields.size() + edt_fields.size()) + num_cached, time,
+                 (int)direct_fields.size(), (int)fft_fields.size(), (int)edt_fields.size(), num_cached);
+        for (const auto &item : this->kdeFields) {
+            ROS_INFO("bandwidth = %f, scale = %f, size = (%d, %d)", item.first, item.second->scale, item.second->rows, item.second->cols);
+        }
+    }
+}
 
-    arma::vec kde_estimations;
-    mlpack::kernel::EpanechnikovKernel kernel(bandwidth);
-    mlpack::metric::EuclideanDistance metric;
-    mlpack::kde::KDE<EpanechnikovKernel, mlpack::metric::EuclideanDistance, arma::mat> kde(default_rel_error, 0.00, kernel);
-    kde.Train(std::move(reference));
-    kde.Evaluate(query, kde_estimations);
+const KdeField &OmniProcess::kdeField(double bandwidth) {
+    if (!this->kdeFields.count(bandwidth)) {
+        kdePyramid({bandwidth});
+    }
+    return *this->kdeFields.at(bandwidth);
+}
+
+/** edge columns sorted within each row, prefix sums of c and c^2 are exact in double **/
+KdeEdgeRows OmniProcess::kdeEdgeRows() {
+    const int kRows = this->kImageSize.first;
+    KdeEdgeRows edge_rows;
+    vector<int> &row_begin = edge_rows.rowBegin;
+    row_begin.assign(kRows + 1, 0);
+    for (const auto &pt : this->ocamEdgeCloud->points) {
+        ++row_begin[(int)pt.x + 1];
+    }
+    partial_sum(row_begin.begin(), row_begin.end(), row_begin.begin());
+    vector<double> &cols = edge_rows.cols;
+    cols.resize(row_begin.back());
+    vector<int> row_fill(row_begin.begin(), row_begin.end() - 1);
+    for (const auto &pt : this->ocamEdgeCloud->points) {
+        cols[row_fill[(int)pt.x]++] = pt.y;
+    }
+    for (int r = 0; r < kRows; ++r) {
+        sort(cols.begin() + row_begin[r], cols.begin() + row_begin[r + 1]);
+    }
+    edge_rows.sumC.assign(cols.size() + 1, 0);
+    edge_rows.sumC2.assign(cols.size() + 1, 0);
+    for (int k = 0; k < (int)cols.size(); ++k) {
+        edge_rows.sumC[k + 1] = edge_rows.sumC[k] + cols[k];
+        edge_rows.sumC2[k + 1] = edge_rows.sumC2[k] + cols[k] * cols[k];
+    }
+    return edge_rows;
+}
+
+/** exact kernel sums at any grid scale, cost grows linearly with the bandwidth **/
+void OmniProcess::kdeDirect(const KdeEdgeRows &edge_rows, KdeField &field) {
+    const int kRows = this->kImageSize.first;
+    const double bandwidth = field.bandwidth;
+    const double kBw2 = bandwidth * bandwidth;
+    const vector<int> &row_begin = edge_rows.rowBegin;
+    const vector<double> &cols = edge_rows.cols, &sum_c = edge_rows.sumC, &sum_c2 = edge_rows.sumC2;
+    const double kNormalizer = kdeNormalizer(bandwidth);
+
+    #pragma omp parallel for num_threads(THREADS) schedule(dynamic, 8)
+    for (int i = 0; i < field.rows; ++i) {
+        const double qr = i / field.scale;
+        int ranges[4];
+        const int num_ranges = kdeRowRanges(field, i, ranges);
+        if (num_ranges == 0) {
+            continue;
+        }
+        /** sums are kept in double, the grid only receives the normalized row **/
+        vector<double> field_row(field.cols, 0);
+        const int r_begin = max(0, (int)ceil(qr - bandwidth));
+        const int r_end = min(kRows - 1, (int)floor(qr + bandwidth));
+        for (int r = r_begin; r <= r_end; ++r) {
+            const double rem = kBw2 - (r - qr) * (r - qr);
+            if (row_begin[r] == row_begin[r + 1] || rem <= 0) {
+                continue;
+            }
+            /** the kernel row is the chord |c - qc| < w, both ends only move right along the query row **/
+            const double w = sqrt(rem);
+            int lo = row_begin[r], hi = row_begin[r];
+            for (int k = 0; k < num_ranges; ++k) {
+                for (int j = ranges[2 * k]; j < ranges[2 * k + 1]; ++j) {
+                    const double qc = j / field.scale;
+                    while (lo < row_begin[r + 1] && cols[lo] <= qc - w) { ++lo; }
+                    while (hi < row_begin[r + 1] && cols[hi] < qc + w) { ++hi; }
+                    const int n = hi - lo;
+                    if (n > 0) {
+                        /** sum of 1 - ((r - qr)^2 + (c - qc)^2) / h^2 over the chord **/
+                        const double s1 = sum_c[hi] - sum_c[lo], s2 = sum_c2[hi] - sum_c2[lo];
+                        field_row[j] += (n * (rem - qc * qc) + 2 * qc * s1 - s2) / kBw2;
+                    }
+                }
+            }
+        }
+        KdeScalar *grid_row = field.data() + (size_t)i * field.cols;
+        for (int k = 0; k < num_ranges; ++k) {
+            for (int j = ranges[2 * k]; j < ranges[2 * k + 1]; ++j) {
+                grid_row[j] = field_row[j] * kNormalizer;
+            }
+        }
+    }
+}
 
-    std::vector<double> img = arma::conv_to<std::vector<double>>::from(kde_estimations);
+/** full pixel lattice only, the kernel is wrapped around the origin of the padded mask spectrum **/
+void OmniProcess::kdeFft(const cv::Mat &mask_spectrum, KdeField &field) {
+    const double bandwidth = field.bandwidth;
+    const int kRadius = ceil(bandwidth);
+    cv::Mat kernel_spectrum = cv::Mat::zeros(mask_spectrum.size(), CV_64F);
+    for (int dr = -kRadius; dr <= kRadius; ++dr) {
+        for (int dc = -kRadius; dc <= kRadius; ++dc) {
+            const double val = 1 - (dr * dr + dc * dc) / (bandwidth * bandwidth);
+            if (val > 0) {
+                kernel_spectrum.at<double>((dr + kernel_spectrum.rows) % kernel_spectrum.rows,
+                                           (dc + kernel_spectrum.cols) % kernel_spectrum.cols) = val;
+            }
+        }
+    }
+    cv::dft(kernel_spectrum, kernel_spectrum);
+    cv::mulSpectrums(mask_spectrum, kernel_spectrum, kernel_spectrum, 0);
+    cv::dft(kernel_spectrum, kernel_spectrum, cv::DFT_INVERSE | cv::DFT_SCALE | cv::DFT_REAL_OUTPUT, field.rows);
+    const double kNormalizer = kdeNormalizer(bandwidth);
+    #pragma omp parallel for num_threads(THREADS)
+    for (int i = 0; i < field.rows; ++i) {
+        int ranges[4];
+        const int num_ranges = kdeRowRanges(field, i, ranges);
+        const double *src_row = kernel_spectrum.ptr<double>(i);
+        KdeScalar *grid_row = field.data() + (size_t)i * field.cols;
+        for (int k = 0; k < num_ranges; ++k) {
+            for (int j = ranges[2 * k]; j < ranges[2 * k + 1]; ++j) {
+                grid_row[j] = src_row[j] * kNormalizer;
+            }
+        }
+    }
+}
 
-    if (EXTRA_FILE_EN) {
-        /** Kde Prediction **/
-        ofstream outfile;
-        outfile.open(this->cocalibKdePath, ios::out);
-        if (!outfile.is_open()) {
-            cout << "Open file failure" << endl;
+/** squared distance of every pixel to the nearest edge pixel, separable transform over columns then rows **/
+vector<float> OmniProcess::edgeDistance() {
+    const int kRows = this->kImageSize.first, kCols = this->kImageSize.second;
+    const float kInf = 1e20f;
+    vector<float> edge_dist((size_t)kRows * kCols, kInf);
+    for (const auto &pt : this->ocamEdgeCloud->points) {
+        edge_dist[(size_t)pt.x * kCols + (size_t)pt.y] = 0;
+    }
+    #pragma omp parallel num_threads(THREADS)
+    {
+        const int kMax = max(kRows, kCols);
+        vector<float> f(kMax), d(kMax), z(kMax + 1);
+        vector<int> v(kMax);
+        #pragma omp for
+        for (int j = 0; j < kCols; ++j) {
+            for (int i = 0; i < kRows; ++i) {
+                f[i] = edge_dist[(size_t)i * kCols + j];
+            }
+            distanceTransform1D(f.data(), d.data(), kRows, v.data(), z.data());
+            for (int i = 0; i < kRows; ++i) {
+                edge_dist[(size_t)i * kCols + j] = d[i];
+            }
+        }
+        #pragma omp for
+        for (int i = 0; i < kRows; ++i) {
+            float *row = edge_dist.data() + (size_t)i * kCols;
+            distanceTransform1D(row, d.data(), kCols, v.data(), z.data());
+            copy(d.begin(), d.begin() + kCols, row);
         }
-        for (int i = 0; i < n_rows; ++i) {
-            for (int j = 0; j < n_cols; j++) {
-                int index = i * n_cols + j;
-                outfile << query.at(0, index) << "\t"
-                        << query.at(1, index) << "\t"
-                        << kde_estimations(index) << endl;
+    }
+    return edge_dist;
+}
+
+/** truncated distance field, the bandwidth plays the truncation radius and every edge pixel scores 1 **/
+void OmniProcess::distanceField(const vector<float> &edge_dist, KdeField &field) {
+    const int kRows = this->kImageSize.first, kCols = this->kImageSize.second;
+    const double kBw2 = field.bandwidth * field.bandwidth;
+    #pragma omp parallel for num_threads(THREADS)
+    for (int i = 0; i < field.rows; ++i) {
+        int ranges[4];
+        const int num_ranges = kdeRowRanges(field, i, ranges);
+        const int r = min((int)lround(i / field.scale), kRows - 1);
+        KdeScalar *grid_row = field.data() + (size_t)i * field.cols;
+        for (int k = 0; k < num_ranges; ++k) {
+            for (int j = ranges[2 * k]; j < ranges[2 * k + 1]; ++j) {
+                const int c = min((int)lround(j / field.scale), kCols - 1);
+                grid_row[j] = max(0.0, 1 - edge_dist[(size_t)r * kCols + c] / kBw2);
             }
         }
-        outfile.close();
     }
+}
+
+/** column ranges [ranges[2k], ranges[2k + 1]) of grid row i that are evaluated, returns the number of ranges **/
+/** with kKdeAnnulus only the disk of the outer effective radius around the initial principal point, **/
+/** widened by kKdeMargin, is kept, the hole inside the annulus still holds edge pixels and is evaluated **/
+int OmniProcess::kdeRowRanges(const KdeField &field, int i, int ranges[4]) {
+    if (!this->kKdeAnnulus) {
+        ranges[0] = 0;
+        ranges[1] = field.cols;
+        return 1;
+    }
+    const double kOuter = this->kEffectiveRadius.second + this->kKdeMargin;
+    const double dr = i / field.scale - this->int_(0);
+    if (dr * dr >= kOuter * kOuter) {
+        return 0;
+    }
+    const double w_outer = sqrt(kOuter * kOuter - dr * dr);
+    ranges[0] = max(0, (int)floor((this->int_(1) - w_outer) * field.scale));
+    ranges[1] = min(field.cols, (int)ceil((this->int_(1) + w_outer) * field.scale) + 1);
+    return (ranges[0] < ranges[1]) ? 1 : 0;
+}
+
+double OmniProcess::kdeNormalizer(double bandwidth) {
+    return 1.0 / (this->ocamEdgeCloud->size() * M_PI * bandwidth * bandwidth / 2);
+}
+
+KdeField::KdeField(double bandwidth, double scale, int rows, int cols)
+    : bandwidth(bandwidth), scale(scale), rows(rows), cols(cols) {}
+
+void KdeField::allocate() {
+    this->grid.assign((size_t)this->rows * this->cols, 0);
+}
+
+void KdeField::map(std::shared_ptr<const KdeScalar> mapped_grid, double ref_val) {
+    vector<KdeScalar>().swap(this->grid);
+    this->mapped = std::move(mapped_grid);
+    this->refVal = ref_val;
+    this->gridAdapter.reset(new ceres::Grid2D<KdeScalar>(values(), 0, this->rows, 0, this->cols));
+    this->bicubic.reset(new ceres::BiCubicInterpolator<ceres::Grid2D<KdeScalar>>(*this->gridAdapter));
+}
+
+/** called once the computed grid is filled **/
+void KdeField::build() {
+    double ref_val = 0;
+    #pragma omp parallel for num_threads(THREADS) reduction(max:ref_val)
+    for (size_t i = 0; i < this->grid.size(); ++i) {
+        ref_val = max(ref_val, (double)this->grid[i]);
+    }
+    this->refVal = ref_val;
+    this->gridAdapter.reset(new ceres::Grid2D<KdeScalar>(values(), 0, this->rows, 0, this->cols));
+    this->bicubic.reset(new ceres::BiCubicInterpolator<ceres::Grid2D<KdeScalar>>(*this->gridAdapter));
+}
+
+/** central differences on the clamped grid, the node derivatives of the bicubic interpolator **/
+void KdeField::buildGradient() {
+    const KdeScalar *grid_values = values();
+    this->gradientGrid.resize((size_t)3 * this->rows * this->cols);
+    #pragma omp parallel for num_threads(THREADS)
+    for (int i = 0; i < this->rows; ++i) {
+        const KdeScalar *row_prev = grid_values + (size_t)max(i - 1, 0) * this->cols;
+        const KdeScalar *row = grid_values + (size_t)i * this->cols;
+        const KdeScalar *row_next = grid_values + (size_t)min(i + 1, this->rows - 1) * this->cols;
+        KdeScalar *packed = this->gradientGrid.data() + (size_t)3 * i * this->cols;
+        for (int j = 0; j < this->cols; ++j) {
+            packed[3 * j] = row[j];
+            packed[3 * j + 1] = 0.5 * (row_next[j] - row_prev[j]);
+            packed[3 * j + 2] = 0.5 * (row[min(j + 1, this->cols - 1)] - row[max(j - 1, 0)]);
+        }
+    }
+    this->gradientLookup.reset(new GradientInterpolator(this->gradientGrid.data(), this->rows, this->cols));
+}
+
+/** the cache file layout: KdeCacheHeader, then rows * cols KdeScalar in row major order **/
+struct KdeCacheHeader {
+    char magic[8];
+    uint64_t key;
+    double bandwidth;
+    double scale;
+    int32_t rows;
+    int32_t cols;
+    double refVal;
+    int32_t scalarBytes;
+    int32_t reserved;
+};
+static const char kKdeCacheMagic[8] = {'C', 'O', 'K', 'D', 'E', 'v', '2', '\0'};
+
+/** the field only depends on the edge pixels, the bandwidth and the grid **/
+uint64_t OmniProcess::kdeKey(const KdeField &field) {
+    uint64_t key = fnv1a(kKdeCacheMagic, sizeof(kKdeCacheMagic));
+    key = fnv1a(&this->kImageSize.first, sizeof(int), key);
+    key = fnv1a(&this->kImageSize.second, sizeof(int), key);
+    key = fnv1a(&field.bandwidth, sizeof(double), key);
+    key = fnv1a(&field.scale, sizeof(double), key);
+    key = fnv1a(&field.rows, sizeof(int), key);
+    key = fnv1a(&field.cols, sizeof(int), key);
+    key = fnv1a(&this->kDistanceField, sizeof(bool), key);
+    if (this->kKdeAnnulus) {
+        key = fnv1a(&this->kEffectiveRadius.second, sizeof(int), key);
+        key = fnv1a(&this->kKdeMargin, sizeof(double), key);
+        key = fnv1a(&this->int_(0), sizeof(double), key);
+        key = fnv1a(&this->int_(1), sizeof(double), key);
+    }
+    for (const auto &pt : this->ocamEdgeCloud->points) {
+        key = fnv1a(&pt.x, sizeof(float), key);
+        key = fnv1a(&pt.y, sizeof(float), key);
+    }
+    return key;
+}
+
+string OmniProcess::kdeCacheFile(uint64_t key) {
+    char name[32];
+    snprintf(name, sizeof(name), "/kde_%016llx.bin", (unsigned long long)key);
+    return this->kdeCachePath + name;
+}
+
+/** maps the cached grid read only, the mapping lives as long as the field **/
+bool OmniProcess::loadKdeCache(KdeField &field) {
+    const uint64_t key = kdeKey(field);
+    const string cache_file = kdeCacheFile(key);
+    int fd = open(cache_file.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat file_stat;
+    const size_t kGridBytes = sizeof(KdeScalar) * field.rows * field.cols;
+    if (fstat(fd, &file_stat) != 0 || (size_t)file_stat.st_size != sizeof(KdeCacheHeader) + kGridBytes) {
+        close(fd);
+        return false;
+    }
+    void *addr = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+    const KdeCacheHeader *header = static_cast<const KdeCacheHeader *>(addr);
+    if (memcmp(header->magic, kKdeCacheMagic, sizeof(kKdeCacheMagic)) != 0 || header->key != key
+        || header->bandwidth != field.bandwidth || header->scale != field.scale
+        || header->rows != field.rows || header->cols != field.cols || header->scalarBytes != (int)sizeof(KdeScalar)) {
+        munmap(addr, file_stat.st_size);
+        return false;
+    }
+    madvise(addr, file_stat.st_size, MADV_WILLNEED);
+    const size_t kMapBytes = file_stat.st_size;
+    shared_ptr<const void> mapping(addr, [kMapBytes](const void *ptr) { munmap(const_cast<void *>(ptr), kMapBytes); });
+    field.map(shared_ptr<const KdeScalar>(mapping, reinterpret_cast<const KdeScalar *>(header + 1)), header->refVal);
     if (MESSAGE_EN) {
-        ROS_INFO("Kde image generated in %f s.\n bandwidth = %f, size = (%d, %d)", ((float)(clock() - start_time) / CLOCKS_PER_SEC), bandwidth, n_rows, n_cols);
+        ROS_INFO("Kde field of bandwidth %f mapped from %s", field.bandwidth, cache_file.c_str());
+    }
+    return true;
+}
+
+/** written to a temporary file and renamed, a crashed run never leaves a truncated entry **/
+void OmniProcess::saveKdeCache(const KdeField &field) {
+    KdeCacheHeader header = {};
+    memcpy(header.magic, kKdeCacheMagic, sizeof(kKdeCacheMagic));
+    header.key = kdeKey(field);
+    header.bandwidth = field.bandwidth;
+    header.scale = field.scale;
+    header.rows = field.rows;
+    header.cols = field.cols;
+    header.refVal = field.refVal;
+    header.scalarBytes = sizeof(KdeScalar);
+    const string cache_file = kdeCacheFile(header.key);
+    const string tmp_file = cache_file + ".tmp";
+    ofstream outfile(tmp_file, ios::out | ios::binary);
+    if (!outfile.is_open()) {
+        ROS_WARN("Open kde cache failure: %s", tmp_file.c_str());
+        return;
+    }
+    outfile.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    outfile.write(reinterpret_cast<const char *>(field.values()), sizeof(KdeScalar) * field.rows * field.cols);
+    outfile.close();
+    if (!outfile || rename(tmp_file.c_str(), cache_file.c_str()) != 0) {
+        ROS_WARN("Write kde cache failure: %s", cache_file.c_str());
+        remove(tmp_file.c_str());
     }
-    return img;
 }
@@ -1,50 +1,8 @@
 /** headings **/
-#include <optimization.h>
-#include <common_lib.h>
+#include <cost_functions.h>
 
 ofstream outfile;
 
-struct QuaternionFunctor {
-    template <typename T>
-    bool operator()(const T *const q_, const T *const t_, const T *const intrinsic_, T *cost) const {
-        Eigen::Quaternion<T> q{q_[3], q_[0], q_[1], q_[2]};
-        Eigen::Matrix<T, 3, 3> R = q.toRotationMatrix();
-        Eigen::Matrix<T, 3, 1> t(t_);
-        Eigen::Matrix<T, K_INT, 1> intrinsic(intrinsic_);
-        Eigen::Matrix<T, 3, 1> lidar_point = R * lid_point_.cast<T>() + t;
-        Eigen::Matrix<T, 2, 1> projection = IntrinsicTransform(intrinsic, lidar_point);
-        T res, val;
-        kde_interpolator_.Evaluate(projection(0) * T(kde_scale_), projection(1) * T(kde_scale_), &val);
-        res = T(weight_) * (T(kde_val_) - val);
-        cost[0] = res;
-        cost[1] = res;
-        cost[2] = res;
-        return true;
-    }
-
-    QuaternionFunctor(const Vec3D lid_point,
-                    const double weight,
-                    const double ref_val,
-                    const double scale,
-                    const ceres::BiCubicInterpolator<ceres::Grid2D<double>> &interpolator)
-                    : lid_point_(std::move(lid_point)), kde_interpolator_(interpolator), weight_(std::move(weight)), kde_val_(std::move(ref_val)), kde_scale_(std::move(scale)) {}
-
-    static ceres::CostFunction *Create(const Vec3D &lid_point,
-                                       const double &weight,
-                                       const double &kde_val,
-                                       const double &kde_scale,
-                                       const ceres::BiCubicInterpolator<ceres::Grid2D<double>> &interpolator) {
-        return new ceres::AutoDiffCostFunction<QuaternionFunctor, 3, ((6+1)-3), 3, K_INT>(
-                new QuaternionFunctor(lid_point, weight, kde_val, kde_scale, interpolator));
-    }
-
-    const Vec3D lid_point_;
-    const double weight_;
-    const double kde_val_;
-    const double kde_scale_;
-    const ceres::BiCubicInterpolator<ceres::Grid2D<double>> &kde_interpolator_;
-};
-
 double project2Image(OmniProcess &omni, LidarProcess &lidar, std::vector<double> &params, std::string record_path, double bandwidth) {
     ofstream outfile;
     Ext_D extrinsic = Eigen::Map<Param_D>(params.data()).head(6);
@@ -82,113 +40,588 @@ double project2Image(OmniProcess &omni, LidarProcess &lidar, std::vector<double>
     return proj_error;
 }
 
-std::vector<double> QuaternionCalib(OmniProcess &omni,
-                                    LidarProcess &lidar,
-                                    double bandwidth,
-                                    std::vector<int> spot_vec,
-                                    std::vector<double> init_params_vec,
-                                    std::vector<double> lb,
-                                    std::vector<double> ub,
-                                    bool lock_intrinsic) {
-    Param_D init_params = Eigen::Map<Param_D>(init_params_vec.data());
+CalibSession::CalibSession(OmniProcess &omni,
+                           LidarProcess &lidar,
+                           std::vector<double> init_params_vec,
+                           std::vector<double> lb,
+                           std::vector<double> ub,
+                           bool lock_intrinsic)
+                           : CalibSession({{&omni, &lidar}}, init_params_vec, lb, ub, lock_intrinsic, false) {
+}
+
+CalibSession::CalibSession(std::vector<CalibSpot> spots,
+                           std::vector<double> init_params_vec,
+                           std::vector<double> lb,
+                           std::vector<double> ub,
+                           bool lock_intrinsic,
+                           bool spot_extrinsics)
+                           : spots(std::move(spots)), lb(std::move(lb)), ub(std::move(ub)),
+                             lockIntrinsic(lock_intrinsic), spotExtrinsics(spot_extrinsics) {
+    /** sized once, the residual blocks keep references into bindings **/
+    this->bindings.resize(this->spots.size());
+    ros::param::get("switch/kSolverTelemetry", this->kSolverTelemetry);
+    ros::param::get("switch/kVisibilityCull", this->kVisibilityCull);
+    /** the Q_LIM box keeps the unit quaternion within 2 Q_LIM of the stage start, 2 asin(Q_LIM) apart, **/
+    /** so a stage rotates by at most 4 asin(Q_LIM), the culling also covers the drift prepare accepts **/
+    const double stage_rotation = 4 * asin(Q_LIM);
+    this->cullDrift = kCullDriftRatio * stage_rotation;
+    this->cullRotation = stage_rotation + this->cullDrift;
+    for (auto &binding : this->bindings) {
+        binding.counters = (this->kSolverTelemetry) ? &this->counters : nullptr;
+    }
+    this->edgeClouds.resize(this->spots.size());
+    this->extrinsics.resize(this->spotExtrinsics ? this->spots.size() : 1);
+    setParams(init_params_vec);
+}
+
+/** euler [rx, ry, rz, tx, ty, tz, intrinsic] to the quaternion layout [qx, qy, qz, qw, tx, ty, tz] and the intrinsic, for every spot **/
+void CalibSession::setParams(std::vector<double> params_vec) {
+    Param_D init_params = Eigen::Map<Param_D>(params_vec.data());
     Ext_D extrinsic = init_params.head(6);
-    MatD(K_INT+(6+1), 1) q_vector;
     Mat3D rotation_mat = transformMat(extrinsic).topLeftCorner(3, 3);
     Eigen::Quaterniond quaternion(rotation_mat);
-    ceres::EigenQuaternionManifold *q_manifold = new ceres::EigenQuaternionManifold();
-    
-    const int kParams = q_vector.size();
-    const double scale = KDE_SCALE;
-    q_vector.tail(K_INT + 3) = init_params.tail(K_INT + 3);
-    q_vector.head(4) << quaternion.x(), quaternion.y(), quaternion.z(), quaternion.w();
-    double params[kParams];
-    memcpy(params, &q_vector(0), q_vector.size() * sizeof(double));
-
-    /********* Initialize Ceres Problem *********/
-    ceres::Problem problem;
-    problem.AddParameterBlock(params, ((6+1)-3), q_manifold);
-    problem.AddParameterBlock(params+((6+1)-3), 3);
-    problem.AddParameterBlock(params+(6+1), K_INT);
-    ceres::LossFunction *loss_function = new ceres::HuberLoss(0.05);
+    for (auto &q_vector : this->extrinsics) {
+        q_vector = {quaternion.x(), quaternion.y(), quaternion.z(), quaternion.w(),
+                    extrinsic(3), extrinsic(4), extrinsic(5)};
+    }
+    Eigen::Map<Int_D>(this->intrinsic) = init_params.tail(K_INT);
+}
 
-    /********* Fisheye KDE *********/
-    std::vector<double> fisheye_kde = omni.Kde(bandwidth, scale);
-    double *kde_val = new double[fisheye_kde.size()];
-    memcpy(kde_val, &fisheye_kde[0], fisheye_kde.size() * sizeof(double));
-    ceres::Grid2D<double> grid(kde_val, 0, omni.kImageSize.first * scale, 0, omni.kImageSize.second * scale);
-    double ref_val = *max_element(fisheye_kde.begin(), fisheye_kde.end());
-    ceres::BiCubicInterpolator<ceres::Grid2D<double>> interpolator(grid);
+std::vector<double> CalibSession::getParams(int spot) const {
+    const std::array<double, (6+1)> &q_vector = this->extrinsics[this->spotExtrinsics ? spot : 0];
+    Param_D result;
+    result.head(3) = Eigen::Quaterniond(q_vector[3], q_vector[0], q_vector[1], q_vector[2]).matrix().eulerAngles(2,1,0).reverse();
+    result.segment(3, 3) << q_vector[4], q_vector[5], q_vector[6];
+    result.tail(K_INT) = Eigen::Map<const Int_D>(this->intrinsic);
+    return std::vector<double>(result.data(), result.data() + result.size());
+}
+
+/** indices of the edge points that may project into the annulus, widened by margin pixels, for any parameters **/
+/** within rotation_margin rad of q_vector = [qx, qy, qz, qw, tx, ty, tz] and with translation and intrinsic inside [lb, ub] **/
+/** a point P = R p + t moves by at most |p| rotation_margin + |dt|, so its ray angle theta moves by at most delta, **/
+/** it is kept if any theta bin within delta can reach the annulus radii under the intrinsic bounds **/
+std::vector<int> visibleEdgePoints(const EdgeCloud &cloud,
+                                   const double *q_vector,
+                                   const std::vector<double> &lb,
+                                   const std::vector<double> &ub,
+                                   double rotation_margin,
+                                   Pair annulus,
+                                   double margin) {
+    const int kBins = 4096;
+    const double bin_size = M_PI / kBins;
+    /** r(theta) = sum a_k theta^k is monotone in every a_k for theta >= 0, so the bounds hold the radius of any intrinsic **/
+    const double *a_lb = lb.data() + 8, *a_ub = ub.data() + 8;
+    double lipschitz = 0;
+    for (int k = 1; k < 5; ++k) {
+        lipschitz += std::max(fabs(a_lb[k]), fabs(a_ub[k])) * k * pow(M_PI, k - 1);
+    }
+    auto radius = [](const double *a, double theta) {
+        return a[0] + theta * (a[1] + theta * (a[2] + theta * (a[3] + theta * a[4])));
+    };
+    /** the affine A = I + E with |E| <= affine, scales the radius by [1 / (1 + affine), 1 / (1 - affine)] **/
+    /** and moves the principal point by |A^-1 - I| |uv_0| <= affine / (1 - affine) |uv_0| **/
+    const double affine = std::max(fabs(lb[13] - 1), fabs(ub[13] - 1))
+                          + std::max(fabs(lb[14]), fabs(ub[14])) + std::max(fabs(lb[15]), fabs(ub[15]));
+    const double uv_0 = Vec2D(std::max(fabs(lb[6]), fabs(ub[6])), std::max(fabs(lb[7]), fabs(ub[7]))).norm();
+    const double shift = affine / (1 - affine) * uv_0;
+    std::vector<int> visible_sum(kBins + 1, 0);
+    for (int k = 0; k < kBins; ++k) {
+        const double theta_a = k * bin_size, theta_b = (k + 1) * bin_size;
+        const double r_lo = std::min(radius(a_lb, theta_a), radius(a_lb, theta_b)) - lipschitz * bin_size;
+        const double r_hi = std::max(radius(a_ub, theta_a), radius(a_ub, theta_b)) + lipschitz * bin_size;
+        /** a negative radius mirrors the projection **/
+        const double abs_lo = (r_lo <= 0 && r_hi >= 0) ? 0 : std::min(fabs(r_lo), fabs(r_hi));
+        const double abs_hi = std::max(fabs(r_lo), fabs(r_hi));
+        const double image_lo = abs_lo / (1 + affine) - shift;
+        const double image_hi = abs_hi / (1 - affine) + shift;
+        const bool visible = (image_hi >= annulus.first - margin) && (image_lo <= annulus.second + margin);
+        visible_sum[k + 1] = visible_sum[k] + visible;
+    }
+
+    /** largest translation step inside the bounds **/
+    Vec3D t_step;
+    for (int i = 0; i < 3; ++i) {
+        t_step(i) = std::max(ub[3 + i] - q_vector[4 + i], q_vector[4 + i] - lb[3 + i]);
+    }
+    const double t_margin = t_step.norm();
+    const Mat3D R = Eigen::Quaterniond(q_vector[3], q_vector[0], q_vector[1], q_vector[2]).toRotationMatrix();
+    const Vec3D t(q_vector[4], q_vector[5], q_vector[6]);
+    std::vector<int> indices;
+    for (int i = 0; i < (int)cloud.size(); ++i) {
+        const Vec3D point(cloud.points[i].x, cloud.points[i].y, cloud.points[i].z);
+        const Vec3D P = R * point + t;
+        const double reach = (point.norm() * rotation_margin + t_margin) / P.norm();
+        if (!(reach < 1)) {
+            indices.push_back(i);
+            continue;
+        }
+        const double theta = acos(std::clamp(P(2) / P.norm(), -1.0, 1.0));
+        const double delta = asin(reach);
+        const int bin_a = std::clamp((int)floor((theta - delta) / bin_size), 0, kBins - 1);
+        const int bin_b = std::clamp((int)floor((theta + delta) / bin_size), 0, kBins - 1);
+        if (visible_sum[bin_b + 1] - visible_sum[bin_a] > 0) {
+            indices.push_back(i);
+        }
+    }
+    return indices;
+}
+
+/** residual blocks over the current edge cloud level of every spot, parameter blocks and the fixed bounds **/
+/** one intrinsic block is shared by all spots, the extrinsic blocks are shared unless spotExtrinsics **/
+void CalibSession::buildProblem() {
+    this->problem.reset(new ceres::Problem);
+    ceres::Problem &problem = *this->problem;
+    for (auto &q_vector : this->extrinsics) {
+        problem.AddParameterBlock(q_vector.data(), ((6+1)-3), new ceres::EigenQuaternionManifold());
+        problem.AddParameterBlock(q_vector.data()+((6+1)-3), 3);
+    }
+    problem.AddParameterBlock(this->intrinsic, K_INT);
+
+    /** the huber loss is applied per point inside the batched blocks **/
+    int num_points = 0, num_culled = 0;
+    for (int s = 0; s < (int)this->spots.size(); ++s) {
+        this->edgeClouds[s] = this->spots[s].lidar->lidarEdgeCloud;
+        /** every spot weighs as much as a single spot run, the weight counts the culled points as well **/
+        this->bindings[s].weight = sqrt(50000.0f / this->edgeClouds[s]->size());
+        double *q_vector = this->extrinsics[this->spotExtrinsics ? s : 0].data();
+        EdgeCloud visible_cloud;
+        if (this->kVisibilityCull) {
+            /** a locked intrinsic is bounded by its current value **/
+            std::vector<double> lb(this->lb), ub(this->ub);
+            if (this->lockIntrinsic) {
+                std::copy(this->intrinsic, this->intrinsic + K_INT, lb.begin() + 6);
+                std::copy(this->intrinsic, this->intrinsic + K_INT, ub.begin() + 6);
+            }
+            /** the field support: bandwidth and the bicubic patch of two grid cells **/
+            const KdeField &field = this->spots[s].omni->kdeField(this->bandwidth);
+            const double margin = this->bandwidth + 2 / field.scale;
+            std::vector<int> indices = visibleEdgePoints(*this->edgeClouds[s], q_vector, lb, ub, this->cullRotation,
+                                                         this->spots[s].omni->kEffectiveRadius, margin);
+            pcl::copyPointCloud(*this->edgeClouds[s], indices, visible_cloud);
+            num_culled += this->edgeClouds[s]->size() - visible_cloud.size();
+        }
+        const EdgeCloud &edge_cloud = (this->kVisibilityCull) ? visible_cloud : *this->edgeClouds[s];
+        for (int begin = 0; begin < (int)edge_cloud.size(); begin += BATCH_SIZE) {
+            const int end = std::min(begin + BATCH_SIZE, (int)edge_cloud.size());
+            problem.AddResidualBlock(new QuaternionBatchCost(edge_cloud, begin, end, this->bindings[s]),
+                                     nullptr,
+                                     q_vector, q_vector+((6+1)-3), this->intrinsic);
+        }
+        num_points += edge_cloud.size();
+    }
+
+    if (this->lockIntrinsic) {
+        problem.SetParameterBlockConstant(this->intrinsic);
+    }
+    for (int i = ((6+1)-3); i < K_INT + (6+1); ++i) {
+        if (i < (6+1)) {
+            for (auto &q_vector : this->extrinsics) {
+                problem.SetParameterLowerBound(q_vector.data()+((6+1)-3), i-((6+1)-3), this->lb[i-1]);
+                problem.SetParameterUpperBound(q_vector.data()+((6+1)-3), i-((6+1)-3), this->ub[i-1]);
+            }
+        }
+        else if (!this->lockIntrinsic) {
+            problem.SetParameterLowerBound(this->intrinsic, i-(6+1), this->lb[i-1]);
+            problem.SetParameterUpperBound(this->intrinsic, i-(6+1), this->ub[i-1]);
+        }
+    }
+    if (this->kVisibilityCull) {
+        this->cullExtrinsics = this->extrinsics;
+        this->cullBandwidth = this->bandwidth;
+    }
+    if (MESSAGE_EN) {
+        ROS_INFO("Ceres problem built: %d residual blocks over %d edge points of %d spots, %d points culled.",
+                 problem.NumResidualBlocks(), num_points, (int)this->spots.size(), num_culled);
+    }
+}
 
-    double weight = sqrt(50000.0f / lidar.lidarEdgeCloud->size());
-    for (auto &point : lidar.lidarEdgeCloud->points) {
-        Vec3D lid_point = {point.x, point.y, point.z};
-        problem.AddResidualBlock(QuaternionFunctor::Create(lid_point, weight, ref_val, scale, interpolator),
-                            loss_function,
-                            params, params+((6+1)-3), params+(6+1));
+/** the problem is only rebuilt when an edge cloud level changes, the parameters stay from the previous stage **/
+void CalibSession::prepare(double bandwidth) {
+    this->bandwidth = bandwidth;
+    this->stageExtrinsics = this->extrinsics;
+    std::copy(this->intrinsic, this->intrinsic + K_INT, this->stageIntrinsic);
+    bool rebuild = !this->problem;
+    for (int s = 0; s < (int)this->spots.size(); ++s) {
+        this->spots[s].lidar->selectPyramidLevel(bandwidth);
+        rebuild |= (this->edgeClouds[s] != this->spots[s].lidar->lidarEdgeCloud);
+    }
+    /** the culling holds for wider fields or stage starts drifted by more than cullDrift only after a rebuild **/
+    if (this->kVisibilityCull && this->problem) {
+        rebuild |= (bandwidth > this->cullBandwidth);
+        for (int e = 0; e < (int)this->extrinsics.size(); ++e) {
+            const auto &q = this->extrinsics[e], &q_cull = this->cullExtrinsics[e];
+            const double drift = Eigen::Quaterniond(q[3], q[0], q[1], q[2]).angularDistance(
+                    Eigen::Quaterniond(q_cull[3], q_cull[0], q_cull[1], q_cull[2]));
+            rebuild |= (drift > this->cullDrift);
+        }
+    }
+    if (rebuild) {
+        buildProblem();
+    }
+    for (int s = 0; s < (int)this->spots.size(); ++s) {
+        this->bindings[s].field = &this->spots[s].omni->kdeField(bandwidth);
     }
 
-    if (lock_intrinsic) {
-        problem.SetParameterBlockConstant(params + (6+1));
+    /** the rotation may move by Q_LIM around the start of each stage **/
+    for (auto &q_vector : this->extrinsics) {
+        for (int i = 0; i < ((6+1)-3); ++i) {
+            this->problem->SetParameterLowerBound(q_vector.data(), i, q_vector[i] - Q_LIM);
+            this->problem->SetParameterUpperBound(q_vector.data(), i, q_vector[i] + Q_LIM);
+        }
     }
+}
 
-    for (int i = 0; i < kParams; ++i) {
-        if (i < ((6+1)-3)) {
-            problem.SetParameterLowerBound(params, i, (q_vector[i]-Q_LIM));
-            problem.SetParameterUpperBound(params, i, (q_vector[i]+Q_LIM));
+/** touches neither omni nor lidar, sessions prepared for the same stage can optimize concurrently **/
+/** one csv row per iteration: ceres iteration summary, evaluation time since the previous row and the parameters **/
+/** the evaluation time is summed over the ceres threads, step_solver_time is the linear solver **/
+class TelemetryCallback : public ceres::IterationCallback {
+public:
+    TelemetryCallback(const std::string &record_path,
+                      const std::vector<std::array<double, (6+1)>> &extrinsics,
+                      const double *intrinsic,
+                      EvalCounters &counters)
+                      : extrinsics(extrinsics), intrinsic(intrinsic), counters(counters) {
+        const std::vector<const char*> name = {
+                "rx", "ry", "rz",
+                "tx", "ty", "tz",
+                "u0", "v0",
+                "a0", "a1", "a2", "a3", "a4",
+                "c", "d", "e"};
+        this->outfile.open(record_path, ios::out);
+        this->outfile << "iteration,cost,cost_change,gradient_norm,step_norm,step_is_successful,trust_region_radius,"
+                      << "linear_solver_iterations,step_solver_time,residual_eval_time,jacobian_eval_time,iteration_time,cumulative_time";
+        for (int s = 0; s < (int)extrinsics.size(); ++s) {
+            for (int i = 0; i < 6; ++i) {
+                this->outfile << "," << name[i] << ((extrinsics.size() > 1) ? "_" + std::to_string(s) : "");
+            }
+        }
+        for (int i = 6; i < 6 + K_INT; ++i) {
+            this->outfile << "," << name[i];
         }
-        if (i >= ((6+1)-3) && i < (6+1)) {
-            problem.SetParameterLowerBound(params+((6+1)-3), i-((6+1)-3), lb[i-1]);
-            problem.SetParameterUpperBound(params+((6+1)-3), i-((6+1)-3), ub[i-1]);
+        this->outfile << endl;
+    }
+
+    ceres::CallbackReturnType operator()(const ceres::IterationSummary &summary) override {
+        this->outfile << summary.iteration << "," << summary.cost << "," << summary.cost_change << ","
+                      << summary.gradient_norm << "," << summary.step_norm << "," << summary.step_is_successful << ","
+                      << summary.trust_region_radius << "," << summary.linear_solver_iterations << ","
+                      << summary.step_solver_time_in_seconds << ","
+                      << this->counters.residualNs.exchange(0) * 1e-9 << ","
+                      << this->counters.jacobianNs.exchange(0) * 1e-9 << ","
+                      << summary.iteration_time_in_seconds << "," << summary.cumulative_time_in_seconds;
+        for (const auto &q_vector : this->extrinsics) {
+            const Vec3D euler = Eigen::Quaterniond(q_vector[3], q_vector[0], q_vector[1], q_vector[2]).matrix().eulerAngles(2,1,0).reverse();
+            this->outfile << "," << euler(0) << "," << euler(1) << "," << euler(2)
+                          << "," << q_vector[4] << "," << q_vector[5] << "," << q_vector[6];
         }
-        else if (i >= (6+1) && !lock_intrinsic) {
-            problem.SetParameterLowerBound(params+(6+1), i-(6+1), lb[i-1]);
-            problem.SetParameterUpperBound(params+(6+1), i-(6+1), ub[i-1]);
+        for (int i = 0; i < K_INT; ++i) {
+            this->outfile << "," << this->intrinsic[i];
         }
+        this->outfile << endl;
+        return ceres::SOLVER_CONTINUE;
     }
 
+private:
+    const std::vector<std::array<double, (6+1)>> &extrinsics;
+    const double *intrinsic;
+    EvalCounters &counters;
+    ofstream outfile;
+};
+
+void CalibSession::optimize() {
     /********* Initial Options *********/
     ceres::Solver::Options options;
     options.linear_solver_type = ceres::DENSE_SCHUR;
     options.trust_region_strategy_type = ceres::LEVENBERG_MARQUARDT;
-    options.minimizer_progress_to_stdout = MESSAGE_EN;
-    options.num_threads = std::thread::hardware_concurrency();
+    options.minimizer_progress_to_stdout = MESSAGE_EN && this->verbose;
+    options.num_threads = this->numThreads;
     options.max_num_iterations = 200;
     options.gradient_tolerance = 1e-6;
     options.function_tolerance = 1e-12;
     options.use_nonmonotonic_steps = true;
 
-    ceres::Solver::Summary summary;
-    ceres::Solve(options, &problem, &summary);
-    std::cout << summary.FullReport() << "\n";
-
-    /********* 2D Image Visualization *********/
-    Param_D result = Eigen::Map<MatD(K_INT+(6+1), 1)>(params).tail(6 + K_INT);
-    result.head(3) = Eigen::Quaterniond(params[3], params[0], params[1], params[2]).matrix().eulerAngles(2,1,0).reverse();
-    std::vector<double> result_vec(&result[0], result.data()+result.cols()*result.rows());
-    extrinsic = result.head(6);
-    /** Save Results**/
-    std::string fusion_image_path = omni.RESULT_PATH + "/fusion_image_" + std::to_string((int)bandwidth) + ".bmp";
-    std::string cocalib_result_path= lidar.RESULT_PATH + "/cocalib_" + std::to_string((int)bandwidth) + ".txt";
-    double proj_error = project2Image(omni, lidar, result_vec, fusion_image_path, bandwidth);
-    saveResults(cocalib_result_path, result_vec, bandwidth, summary.initial_cost, summary.final_cost, proj_error);
-    return result_vec;
+    std::unique_ptr<TelemetryCallback> telemetry;
+    if (this->kSolverTelemetry) {
+        std::string record_path = this->spots[0].lidar->RESULT_PATH + "/solver_" + std::to_string((int)this->bandwidth)
+                                  + this->telemetryTag + ".csv";
+        this->counters.residualNs = 0;
+        this->counters.jacobianNs = 0;
+        telemetry.reset(new TelemetryCallback(record_path, this->extrinsics, this->intrinsic, this->counters));
+        /** the callback reads the parameter blocks **/
+        options.update_state_every_iteration = true;
+        options.callbacks.push_back(telemetry.get());
+    }
+
+    ceres::Solve(options, this->problem.get(), &this->summary);
+}
+
+/** same residuals and cost as the problem, 1/2 sum of squares, evaluated batch by batch without the culling **/
+double CalibSession::fullCost() const {
+    double cost = 0;
+    for (int s = 0; s < (int)this->spots.size(); ++s) {
+        const EdgeCloud &edge_cloud = *this->edgeClouds[s];
+        const std::array<double, (6+1)> &q_vector = this->extrinsics[this->spotExtrinsics ? s : 0];
+        const double *parameters[3] = {q_vector.data(), q_vector.data() + ((6+1)-3), this->intrinsic};
+        const int num_batches = (edge_cloud.size() + BATCH_SIZE - 1) / BATCH_SIZE;
+        #pragma omp parallel for num_threads(THREADS) reduction(+:cost)
+        for (int b = 0; b < num_batches; ++b) {
+            const int begin = b * BATCH_SIZE, end = std::min(begin + BATCH_SIZE, (int)edge_cloud.size());
+            double residuals[BATCH_SIZE];
+            QuaternionBatchCost(edge_cloud, begin, end, this->bindings[s]).Evaluate(parameters, residuals, nullptr);
+            for (int i = 0; i < end - begin; ++i) {
+                cost += 0.5 * residuals[i] * residuals[i];
+            }
+        }
+    }
+    return cost;
+}
+
+/** back to the parameters the last prepared stage started from **/
+void CalibSession::revertStage() {
+    this->extrinsics = this->stageExtrinsics;
+    std::copy(this->stageIntrinsic, this->stageIntrinsic + K_INT, this->intrinsic);
+}
+
+/** results of every spot go to its own result directory, the returned parameters are those of spot 0 **/
+std::vector<double> CalibSession::record(double bandwidth) {
+    for (int s = (int)this->spots.size() - 1; s >= 0; --s) {
+        OmniProcess &omni = *this->spots[s].omni;
+        LidarProcess &lidar = *this->spots[s].lidar;
+        /********* 2D Image Visualization *********/
+        std::vector<double> result_vec = getParams(s);
+        /** Save Results**/
+        std::string fusion_image_path = omni.RESULT_PATH + "/fusion_image_" + std::to_string((int)bandwidth) + ".bmp";
+        std::string cocalib_result_path= lidar.RESULT_PATH + "/cocalib_" + std::to_string((int)bandwidth) + ".txt";
+        double proj_error = project2Image(omni, lidar, result_vec, fusion_image_path, bandwidth);
+        saveResults(cocalib_result_path, result_vec, bandwidth, this->summary.initial_cost, this->summary.final_cost, proj_error);
+    }
+    return getParams(0);
+}
+
+/** warm starts from the previous stage **/
+std::vector<double> CalibSession::solve(double bandwidth) {
+    prepare(bandwidth);
+    optimize();
+    std::cout << this->summary.FullReport() << "\n";
+    return record(bandwidth);
+}
+
+MultiStartCalib::MultiStartCalib(std::vector<CalibSpot> spots,
+                                 std::vector<double> init_params_vec,
+                                 std::vector<double> lb,
+                                 std::vector<double> ub,
+                                 int num_starts,
+                                 bool lock_intrinsic,
+                                 bool spot_extrinsics)
+                                 : lidar(*spots[0].lidar) {
+    /** start 0 is the configured guess, the others are uniform inside [lb, ub], seeded for repeatable runs **/
+    std::mt19937 generator(kSeed);
+    const int num_params = init_params_vec.size();
+    for (int n = 0; n < num_starts; ++n) {
+        std::vector<double> start_vec(init_params_vec);
+        for (int i = 0; n > 0 && i < num_params; ++i) {
+            const bool locked = lock_intrinsic && i >= 6;
+            if (!locked) {
+                start_vec[i] = std::uniform_real_distribution<double>(lb[i], ub[i])(generator);
+            }
+        }
+        this->sessions.emplace_back(new CalibSession(spots, start_vec, lb, ub, lock_intrinsic, spot_extrinsics));
+    }
+    /** the ceres threads of one solve saturate early, the cores are split over the starts instead **/
+    const int num_cores = std::max(1u, std::thread::hardware_concurrency());
+    this->numWorkers = std::min(num_starts, num_cores);
+    for (auto &session : this->sessions) {
+        session->numThreads = std::max(1, num_cores / this->numWorkers);
+        session->verbose = false;
+        session->telemetryTag = "_start" + std::to_string(&session - &this->sessions[0]);
+    }
+}
+
+std::vector<double> MultiStartCalib::solve(double bandwidth) {
+    const int num_starts = this->sessions.size();
+    /** prepare serially, it selects the lidar pyramid level and may build the field **/
+    for (auto &session : this->sessions) {
+        session->prepare(bandwidth);
+    }
+    std::atomic<int> next(0);
+    std::vector<std::thread> workers;
+    for (int w = 0; w < this->numWorkers; ++w) {
+        workers.emplace_back([&]() {
+            for (int n = next++; n < num_starts; n = next++) {
+                this->sessions[n]->optimize();
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    /** culled sessions dropped different points, their final costs only compare on the whole edge clouds **/
+    std::vector<double> costs(num_starts);
+    for (int n = 0; n < num_starts; ++n) {
+        const CalibSession &session = *this->sessions[n];
+        costs[n] = (session.kVisibilityCull) ? session.fullCost() : session.summary.final_cost;
+    }
+    std::vector<int> order(num_starts);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return costs[a] < costs[b];
+    });
+    this->bestIndex = order[0];
+    CalibSession &best = *this->sessions[order[0]];
+    std::cout << best.summary.FullReport() << "\n";
+
+    /** spread of the starts around the best one, rotation as the angle between the two rotations **/
+    std::vector<double> best_vec = best.getParams();
+    Ext_D best_extrinsic = Eigen::Map<Ext_D>(best_vec.data());
+    const Eigen::Quaterniond best_q(Mat3D(transformMat(best_extrinsic).topLeftCorner(3, 3)));
+    std::string record_path = this->lidar.RESULT_PATH + "/multi_start_" + std::to_string((int)bandwidth) + ".txt";
+    ofstream outfile(record_path, ios::out);
+    outfile << "start\tinitial_cost\tfinal_cost\tfull_cost\tangle_to_best\tdistance_to_best\titerations" << endl;
+    double max_angle = 0, max_distance = 0;
+    int num_agree = 0;
+    for (int n : order) {
+        const CalibSession &session = *this->sessions[n];
+        std::vector<double> result_vec = session.getParams();
+        Ext_D extrinsic = Eigen::Map<Ext_D>(result_vec.data());
+        const Eigen::Quaterniond q(Mat3D(transformMat(extrinsic).topLeftCorner(3, 3)));
+        const double angle = q.angularDistance(best_q);
+        const double distance = (extrinsic.tail(3) - best_extrinsic.tail(3)).norm();
+        max_angle = std::max(max_angle, angle);
+        max_distance = std::max(max_distance, distance);
+        num_agree += (costs[n] <= costs[order[0]] * (1 + kAgreeTolerance));
+        outfile << n << "\t" << session.summary.initial_cost << "\t" << session.summary.final_cost << "\t" << costs[n] << "\t"
+                << angle << "\t" << distance << "\t" << session.summary.iterations.size() << endl;
+    }
+    outfile.close();
+    ROS_INFO("Multi start at bw %f: best start %d, final cost [%f, %f, %f] (min, median, max), "
+             "%d / %d starts within %.0f%% of the best, max deviation %f rad, %f m.",
+             bandwidth, order[0],
+             costs[order[0]], costs[order[num_starts / 2]], costs[order.back()],
+             num_agree, num_starts, kAgreeTolerance * 100, max_angle, max_distance);
+    return best.record(bandwidth);
+}
+
+void MultiStartCalib::revertStage() {
+    for (auto &session : this->sessions) {
+        session->revertStage();
+    }
+}
+
+BandwidthScheduler::BandwidthScheduler(std::vector<double> bw, std::vector<double> params_range)
+                                       : queue(bw.begin(), bw.end()), paramsRange(std::move(params_range)) {
+    ros::param::get("essential/kScheduleRotTol", this->kRotTol);
+    ros::param::get("essential/kScheduleTransTol", this->kTransTol);
+    ros::param::get("essential/kScheduleIntTol", this->kIntTol);
+    ros::param::get("essential/kScheduleCostTol", this->kCostTol);
+    ros::param::get("essential/kScheduleMaxInserts", this->kMaxInserts);
+}
+
+double BandwidthScheduler::next() {
+    const double bandwidth = this->queue.front();
+    this->queue.pop_front();
+    return bandwidth;
+}
+
+/** converged: parameters moved less than the tolerances and the cost dropped by less than kCostTol, **/
+/** the next stage is skipped unless it is the last one, so the finest bandwidth always runs **/
+/** diverged: the solver failed, ended above its initial cost or pushed the rotation into the Q_LIM box, **/
+/** the stage is discarded and repeated after the geometric mean of the last kept and this bandwidth, **/
+/** once kMaxInserts are used, or before any kept stage, it is discarded without a retry **/
+bool BandwidthScheduler::update(double bandwidth,
+                                const std::vector<std::vector<double>> &init_spot_vecs,
+                                const std::vector<std::vector<double>> &result_spot_vecs,
+                                const ceres::Solver::Summary &summary,
+                                const std::vector<std::string> &record_paths) {
+    /** the largest change over the spots, a spot pinned at the stage bounds marks the stage diverged **/
+    double rotation = 0, q_step = 0, translation = 0, intrinsic = 0;
+    int worst_spot = 0;
+    for (int s = 0; s < result_spot_vecs.size(); ++s) {
+        const std::vector<double> &init_params_vec = init_spot_vecs[s];
+        const std::vector<double> &result_vec = result_spot_vecs[s];
+        Ext_D init_extrinsic = Eigen::Map<const Ext_D>(init_params_vec.data());
+        Ext_D result_extrinsic = Eigen::Map<const Ext_D>(result_vec.data());
+        const Eigen::Quaterniond init_q(Mat3D(transformMat(init_extrinsic).topLeftCorner(3, 3)));
+        Eigen::Quaterniond result_q(Mat3D(transformMat(result_extrinsic).topLeftCorner(3, 3)));
+        if (init_q.dot(result_q) < 0) {
+            result_q.coeffs() *= -1;
+        }
+        const double spot_rotation = init_q.angularDistance(result_q);
+        if (spot_rotation > rotation) {
+            rotation = spot_rotation;
+            worst_spot = s;
+        }
+        q_step = std::max(q_step, (result_q.coeffs() - init_q.coeffs()).cwiseAbs().maxCoeff());
+        translation = std::max(translation, (result_extrinsic.tail(3) - init_extrinsic.tail(3)).norm());
+        for (int i = 6; i < 6 + K_INT; ++i) {
+            if (this->paramsRange[i] > 0) {
+                intrinsic = std::max(intrinsic, fabs(result_vec[i] - init_params_vec[i]) / this->paramsRange[i]);
+            }
+        }
+    }
+    const double cost_reduction = (summary.initial_cost - summary.final_cost) / std::max(summary.initial_cost, 1e-12);
+
+    const bool diverged = summary.termination_type == ceres::FAILURE
+            || summary.final_cost > summary.initial_cost
+            || q_step >= kPinnedRatio * Q_LIM;
+    const bool converged = rotation < this->kRotTol && translation < this->kTransTol
+            && intrinsic < this->kIntTol && cost_reduction < this->kCostTol;
+
+    std::string decision;
+    bool keep = true;
+    if (diverged && this->numInserts < this->kMaxInserts && this->kept > 0) {
+        const double mid = sqrt(this->kept * bandwidth);
+        this->queue.push_front(bandwidth);
+        this->queue.push_front(mid);
+        this->numInserts++;
+        keep = false;
+        decision = "diverged, result discarded, inserted bw " + to_string(mid) + " before retrying bw " + to_string(int(bandwidth));
+    }
+    else if (converged && this->queue.size() > 1) {
+        decision = "converged, skipped bw " + to_string(int(this->queue.front()));
+        this->queue.pop_front();
+    }
+    else if (diverged) {
+        keep = false;
+        decision = "diverged, result discarded, no bandwidth inserted";
+    }
+    else {
+        decision = "continue";
+    }
+    if (keep) {
+        this->kept = bandwidth;
+    }
+
+    for (const std::string &record_path : record_paths) {
+        ofstream outfile(record_path, ios::app);
+        outfile << "Schedule: " << decision << "\n"
+                << "Worst spot (rotation): " << worst_spot << "\n"
+                << "Rotation change: " << rotation << ", translation change: " << translation
+                << ", intrinsic change / range: " << intrinsic << ", cost reduction: " << cost_reduction << "\n";
+        outfile.close();
+    }
+    ROS_INFO("Schedule at bw %f: %s (largest over %d spots: rotation %e at spot %d, translation %e, intrinsic %e, cost reduction %e).",
+             bandwidth, decision.c_str(), (int)result_spot_vecs.size(), rotation, worst_spot, translation, intrinsic, cost_reduction);
+    return keep;
 }
 
 void costAnalysis(OmniProcess &omni,
                   LidarProcess &lidar,
-                   std::vector<int> spot_vec,
                   std::vector<double> init_params_vec,
                   std::vector<double> result_vec,
                   double bandwidth) {
-    const double scale = KDE_SCALE;
-
     /********* Fisheye KDE *********/
-    std::vector<double> fisheye_kde = omni.Kde(bandwidth, scale);
-    double *kde_val = new double[fisheye_kde.size()];
-    memcpy(kde_val, &fisheye_kde[0], fisheye_kde.size() * sizeof(double));
-    ceres::Grid2D<double> grid(kde_val, 0, omni.kImageSize.first * scale, 0, omni.kImageSize.second * scale);
-    double ref_val = *max_element(fisheye_kde.begin(), fisheye_kde.end());
-    ceres::BiCubicInterpolator<ceres::Grid2D<double>> interpolator(grid);
+    const KdeField &fisheye_kde = omni.kdeField(bandwidth);
+    const double scale = fisheye_kde.scale;
+    const double ref_val = fisheye_kde.refVal;
+    auto interpolate = [&fisheye_kde](double r, double c, double *val) {
+        if (fisheye_kde.hasGradient()) {
+            fisheye_kde.gradient().Evaluate(r, c, val);
+        }
+        else {
+            fisheye_kde.interpolator().Evaluate(r, c, val);
+        }
+    };
 
     /***** Correlation Analysis *****/
     Param_D params_mat = Eigen::Map<Param_D>(result_vec.data());
@@ -284,7 +717,7 @@ void costAnalysis(OmniProcess &omni,
                         Mat4D T_mat = transformMat(extrinsic);
                         Vec3D lidar_point = (T_mat * lidar_point4).head(3);
                         Vec2D projection = IntrinsicTransform(intrinsic, lidar_point);
-                        interpolator.Evaluate(projection(0) * scale, projection(1) * scale, &val);
+                        interpolate(projection(0) * scale, projection(1) * scale, &val);
                         Pair &bounds = omni.kEffectiveRadius;
                         if ((pow(projection(0) - intrinsic(0), 2) + pow(projection(1) - intrinsic(1), 2)) > pow(bounds.first, 2)
                             && (pow(projection(0) - intrinsic(0), 2) + pow(projection(1) - intrinsic(1), 2)) < pow(bounds.second, 2)) {
@@ -307,3 +740,206 @@ void costAnalysis(OmniProcess &omni,
         outfile.close();
     }
 }
+
+/** kde against distance field around the calibrated params, written to RESULT_PATH: **/
+/** cost profiles one extrinsic parameter at a time, the basin is the offset span over which the cost keeps rising, **/
+/** and full schedules from kStarts extrinsics perturbed inside params_range, with their error to params **/
+void fieldBenchmark(OmniProcess &omni,
+                    LidarProcess &lidar,
+                    std::vector<double> params,
+                    std::vector<double> params_range,
+                    std::vector<double> bw,
+                    std::vector<double> lb,
+                    std::vector<double> ub) {
+    const int kSteps = 40; // per side
+    const int kStarts = 4;
+    const char *kFieldNames[2] = {"kde", "edt"};
+    const bool distance_field = omni.kDistanceField, kde_cache = omni.kKdeCache;
+    std::map<double, std::unique_ptr<KdeField>> fields[2];
+    double gen_time[2];
+
+    /** no cache, the generation time is the point **/
+    omni.kKdeCache = false;
+    for (int mode = 0; mode < 2; ++mode) {
+        omni.kDistanceField = mode;
+        omni.kdeFields.clear();
+        auto start_time = std::chrono::steady_clock::now();
+        omni.kdePyramid(bw);
+        gen_time[mode] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        fields[mode] = std::move(omni.kdeFields);
+    }
+
+    Param_D params_mat = Eigen::Map<Param_D>(params.data());
+    auto fieldCost = [&lidar](const KdeField &field, Ext_D extrinsic, Int_D intrinsic) {
+        const Mat4D T_mat = transformMat(extrinsic);
+        const double weight = sqrt(50000.0 / lidar.lidarEdgeCloud->size());
+        const int num_points = lidar.lidarEdgeCloud->size();
+        double cost = 0;
+        #pragma omp parallel for num_threads(THREADS) reduction(+:cost)
+        for (int i = 0; i < num_points; ++i) {
+            const auto &point = lidar.lidarEdgeCloud->points[i];
+            Eigen::Vector4d lidar_point4 = {point.x, point.y, point.z, 1.0};
+            Vec3D lidar_point = (T_mat * lidar_point4).head(3);
+            Vec2D projection = IntrinsicTransform(intrinsic, lidar_point);
+            double val;
+            field.interpolator().Evaluate(projection(0) * field.scale, projection(1) * field.scale, &val);
+            const double res = weight * (field.refVal - val);
+            cost += 0.5 * res * res;
+        }
+        return cost;
+    };
+
+    for (double bandwidth : bw) {
+        lidar.selectPyramidLevel(bandwidth);
+        std::string record_path = lidar.RESULT_PATH + "/field_benchmark_" + std::to_string((int)bandwidth) + ".txt";
+        ofstream outfile(record_path, ios::out);
+        outfile << "param\toffset\tkde\tedt" << endl;
+        for (int m = 0; m < 6; ++m) {
+            /** profile[mode][k], offset (k - kSteps) / kSteps * range, normalized by the cost at params **/
+            std::vector<double> profile[2];
+            const double step = params_range[m] / kSteps;
+            for (int mode = 0; mode < 2; ++mode) {
+                const KdeField &field = *fields[mode].at(bandwidth);
+                for (int k = 0; k <= 2 * kSteps; ++k) {
+                    Ext_D extrinsic = params_mat.head(6);
+                    extrinsic(m) += (k - kSteps) * step;
+                    profile[mode].push_back(fieldCost(field, extrinsic, params_mat.tail(K_INT)));
+                }
+                const double center = std::max(profile[mode][kSteps], 1e-12);
+                for (double &cost : profile[mode]) {
+                    cost /= center;
+                }
+            }
+            for (int k = 0; k <= 2 * kSteps; ++k) {
+                outfile << m << "\t" << (k - kSteps) * step << "\t" << profile[0][k] << "\t" << profile[1][k] << endl;
+            }
+            if (MESSAGE_EN) {
+                int basin[2][2];
+                for (int mode = 0; mode < 2; ++mode) {
+                    int lo = kSteps, hi = kSteps;
+                    while (lo > 0 && profile[mode][lo - 1] >= profile[mode][lo]) { --lo; }
+                    while (hi < 2 * kSteps && profile[mode][hi + 1] >= profile[mode][hi]) { ++hi; }
+                    basin[mode][0] = lo - kSteps;
+                    basin[mode][1] = hi - kSteps;
+                }
+                ROS_INFO("bw %.1f param %d: kde basin [%f, %f], edt basin [%f, %f]", bandwidth, m,
+                         basin[0][0] * step, basin[0][1] * step, basin[1][0] * step, basin[1][1] * step);
+            }
+        }
+        outfile.close();
+    }
+    ROS_INFO("Field generation for %d bandwidths: %s %f s, %s %f s.",
+             (int)bw.size(), kFieldNames[0], gen_time[0], kFieldNames[1], gen_time[1]);
+
+    /** the same perturbed starts for both fields, stages run without writing the stage results **/
+    std::mt19937 generator(2023);
+    std::vector<std::vector<double>> starts(kStarts, params);
+    for (auto &start_vec : starts) {
+        for (int i = 0; i < 6; ++i) {
+            start_vec[i] += std::uniform_real_distribution<double>(-params_range[i], params_range[i])(generator);
+        }
+    }
+    Ext_D ref_extrinsic = params_mat.head(6);
+    const Eigen::Quaterniond ref_q(Mat3D(transformMat(ref_extrinsic).topLeftCorner(3, 3)));
+    std::string record_path = lidar.RESULT_PATH + "/field_benchmark_convergence.txt";
+    ofstream outfile(record_path, ios::out);
+    outfile << "field\tstart\tfinal_cost\trotation_error\ttranslation_error\titerations\tsolve_time" << endl;
+    for (int mode = 0; mode < 2; ++mode) {
+        omni.kdeFields = std::move(fields[mode]);
+        double max_rotation = 0, max_translation = 0, total_time = 0;
+        for (int n = 0; n < kStarts; ++n) {
+            CalibSession session(omni, lidar, starts[n], lb, ub, false);
+            session.verbose = false;
+            /** own telemetry files, the csv of the calibration run stays as it was **/
+            session.telemetryTag = std::string("_benchmark_") + kFieldNames[mode] + "_start" + std::to_string(n);
+            int iterations = 0;
+            auto start_time = std::chrono::steady_clock::now();
+            for (double bandwidth : bw) {
+                session.prepare(bandwidth);
+                session.optimize();
+                iterations += session.summary.iterations.size();
+            }
+            const double solve_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+            std::vector<double> result_vec = session.getParams();
+            Ext_D extrinsic = Eigen::Map<Ext_D>(result_vec.data());
+            const double rotation = Eigen::Quaterniond(Mat3D(transformMat(extrinsic).topLeftCorner(3, 3))).angularDistance(ref_q);
+            const double translation = (extrinsic.tail(3) - ref_extrinsic.tail(3)).norm();
+            max_rotation = std::max(max_rotation, rotation);
+            max_translation = std::max(max_translation, translation);
+            total_time += solve_time;
+            outfile << kFieldNames[mode] << "\t" << n << "\t" << session.summary.final_cost << "\t" << rotation << "\t"
+                    << translation << "\t" << iterations << "\t" << solve_time << endl;
+        }
+        ROS_INFO("%s: %d perturbed starts, max rotation error %f rad, max translation error %f m, %f s per schedule.",
+                 kFieldNames[mode], kStarts, max_rotation, max_translation, total_time / kStarts);
+        fields[mode] = std::move(omni.kdeFields);
+    }
+    outfile.close();
+
+    omni.kDistanceField = distance_field;
+    omni.kKdeCache = kde_cache;
+    omni.kdeFields = std::move(fields[distance_field ? 1 : 0]);
+}
+
+/** compares the analytic jacobians with the AutoDiff QuaternionFunctor on a spread of edge points **/
+/** returns the largest jacobian difference relative to the jacobian norm **/
+double jacobianCheck(OmniProcess &omni,
+                     LidarProcess &lidar,
+                     std::vector<double> params_vec,
+                     double bandwidth) {
+    const int kNumSamples = 1000;
+    Param_D params_mat = Eigen::Map<Param_D>(params_vec.data());
+    Ext_D extrinsic = params_mat.head(6);
+    Eigen::Quaterniond quaternion(Mat3D(transformMat(extrinsic).topLeftCorner(3, 3)));
+    double q[4] = {quaternion.x(), quaternion.y(), quaternion.z(), quaternion.w()};
+    double t[3] = {params_mat(3), params_mat(4), params_mat(5)};
+    Int_D intrinsic = params_mat.tail(K_INT);
+    const double *parameters[3] = {q, t, intrinsic.data()};
+
+    lidar.selectPyramidLevel(bandwidth);
+    const KdeField &fisheye_kde = omni.kdeField(bandwidth);
+    const double weight = sqrt(50000.0f / lidar.lidarEdgeCloud->size());
+    const int num_points = lidar.lidarEdgeCloud->size();
+    const int stride = std::max(1, num_points / kNumSamples);
+    double max_error = 0, max_res_error = 0;
+    auto check = [&](const auto &interpolator) {
+        typedef std::decay_t<decltype(interpolator)> Interpolator;
+        for (int i = 0; i < num_points; i += stride) {
+            const auto &point = lidar.lidarEdgeCloud->points[i];
+            const Vec3D lid_point = {point.x, point.y, point.z};
+            std::unique_ptr<ceres::CostFunction> autodiff(QuaternionFunctor<Interpolator>::Create(
+                    lid_point, weight, fisheye_kde.refVal, fisheye_kde.scale, interpolator));
+            QuaternionAnalyticCost<Interpolator> analytic(lid_point, weight, fisheye_kde.refVal, fisheye_kde.scale, interpolator);
+            double res_auto[3], res_analytic;
+            double jac_auto[3][3 * K_INT], jac_analytic[3][K_INT];
+            double *jac_auto_ptr[3] = {jac_auto[0], jac_auto[1], jac_auto[2]};
+            double *jac_analytic_ptr[3] = {jac_analytic[0], jac_analytic[1], jac_analytic[2]};
+            autodiff->Evaluate(parameters, res_auto, jac_auto_ptr);
+            analytic.Evaluate(parameters, &res_analytic, jac_analytic_ptr);
+            max_res_error = std::max(max_res_error, fabs(res_auto[0] - res_analytic));
+            /** row 0 of each AutoDiff block, the functor repeats its residual **/
+            const int kBlockSize[3] = {((6+1)-3), 3, K_INT};
+            double norm = 0, diff = 0;
+            for (int b = 0; b < 3; ++b) {
+                for (int k = 0; k < kBlockSize[b]; ++k) {
+                    norm = std::max(norm, fabs(jac_auto[b][k]));
+                    diff = std::max(diff, fabs(jac_auto[b][k] - jac_analytic[b][k]));
+                }
+            }
+            max_error = std::max(max_error, diff / std::max(norm, 1e-12));
+        }
+    };
+    if (fisheye_kde.hasGradient()) {
+        check(fisheye_kde.gradient());
+    }
+    else {
+        check(fisheye_kde.interpolator());
+    }
+    if (max_error > 1e-6 || max_res_error > 1e-9) {
+        ROS_WARN("Jacobian check at bw %f: relative jacobian error %e, residual error %e.", bandwidth, max_error, max_res_error);
+    }
+    else if (MESSAGE_EN) {
+        ROS_INFO("Jacobian check at bw %f passed: relative jacobian error %e, residual error %e.", bandwidth, max_error, max_res_error);
+    }
+    return max_error;
+}
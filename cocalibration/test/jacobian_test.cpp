@@ -0,0 +1,204 @@
+/** analytic jacobians of the residual blocks against ceres AutoDiff on a synthetic field, no dataset needed **/
+/** basic **/
+#include <random>
+#include <memory>
+/** gtest **/
+#include <gtest/gtest.h>
+/** headings **/
+#include <cost_functions.h>
+
+namespace {
+
+const double kTolerance = 1e-6; // largest jacobian difference relative to the largest jacobian entry
+const int kNumPoints = 300;
+
+/** default config, with a small affine and distortion so that every intrinsic column is exercised **/
+std::vector<double> testParams() {
+    return {3.1415926, 0.02, -1.5707963, 0.27, 0.00, 0.03,
+            1023.00, 1201.00, 1937.487404, -616.7214056132, 0.5, -0.2, 0.05, 1.002, 0.003, -0.002};
+}
+
+/** smooth field over the 2048 x 2448 image sampled at 0.25, with or without the gradient grid **/
+std::unique_ptr<KdeField> syntheticField(bool gradient) {
+    std::unique_ptr<KdeField> field(new KdeField(8, 0.25, 512, 612));
+    field->allocate();
+    for (int r = 0; r < field->rows; ++r) {
+        for (int c = 0; c < field->cols; ++c) {
+            field->data()[r * field->cols + c] = 0.5 + 0.25 * sin(r / 7.0) * cos(c / 11.0);
+        }
+    }
+    field->build();
+    if (gradient) {
+        field->buildGradient();
+    }
+    return field;
+}
+
+class JacobianTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        std::vector<double> params_vec = testParams();
+        Ext_D extrinsic = Eigen::Map<Param_D>(params_vec.data()).head(6);
+        Eigen::Quaterniond quaternion(Mat3D(transformMat(extrinsic).topLeftCorner(3, 3)));
+        q = {quaternion.x(), quaternion.y(), quaternion.z(), quaternion.w()};
+        t = {params_vec[3], params_vec[4], params_vec[5]};
+        intrinsic.assign(params_vec.begin() + 6, params_vec.end());
+
+        /** random lidar points that project well inside the field **/
+        std::mt19937 generator(7);
+        std::normal_distribution<double> normal(0, 1);
+        std::uniform_real_distribution<double> distance(2, 10);
+        while ((int)cloud.size() < kNumPoints) {
+            Vec3D point(normal(generator), normal(generator), normal(generator));
+            point *= distance(generator) / point.norm();
+            const Vec3D P = quaternion.toRotationMatrix() * point + Vec3D(t[0], t[1], t[2]);
+            if (P.head(2).norm() < 0.1 * P.norm()) {
+                continue;
+            }
+            const Vec2D uv = projectionJacobian(q.data(), t.data(), intrinsic.data(), point, nullptr);
+            if (uv(0) < 40 || uv(0) > 2048 - 40 || uv(1) < 40 || uv(1) > 2448 - 40) {
+                continue;
+            }
+            cloud.push_back(pcl::PointXYZ(point(0), point(1), point(2)));
+        }
+    }
+
+    std::vector<double> q, t, intrinsic;
+    EdgeCloud cloud;
+};
+
+/** image projection of one point, the function projectionJacobian differentiates **/
+struct ProjectionFunctor {
+    template <typename T>
+    bool operator()(const T *const q_, const T *const t_, const T *const intrinsic_, T *uv) const {
+        Eigen::Quaternion<T> q{q_[3], q_[0], q_[1], q_[2]};
+        Eigen::Matrix<T, 3, 1> P = q.toRotationMatrix() * point.cast<T>() + Eigen::Matrix<T, 3, 1>(t_);
+        Eigen::Matrix<T, K_INT, 1> intrinsic(intrinsic_);
+        Eigen::Matrix<T, 2, 1> projection = IntrinsicTransform(intrinsic, P);
+        uv[0] = projection(0);
+        uv[1] = projection(1);
+        return true;
+    }
+    Vec3D point;
+};
+
+/** the per point objective of QuaternionBatchCost: sign(r) sqrt(rho(3 r^2)) of HuberLoss(kHuberDelta) **/
+template <typename Interpolator>
+struct RobustFunctor {
+    template <typename T>
+    bool operator()(const T *const q_, const T *const t_, const T *const intrinsic_, T *res) const {
+        using std::sqrt;
+        const double kDelta = QuaternionBatchCost::kHuberDelta;
+        const T r = kdeResidual(q_, t_, intrinsic_, point, interpolator, weight, ref_val, scale);
+        const T s = T(3) * r * r;
+        if (s <= T(kDelta * kDelta)) {
+            res[0] = T(sqrt(3.0)) * r;
+        }
+        else {
+            const T rho = T(2 * kDelta) * sqrt(s) - T(kDelta * kDelta);
+            res[0] = (r < T(0)) ? T(-sqrt(rho)) : T(sqrt(rho));
+        }
+        return true;
+    }
+    RobustFunctor(const Vec3D &point, const Interpolator &interpolator, double weight, double ref_val, double scale)
+                  : point(point), interpolator(interpolator), weight(weight), ref_val(ref_val), scale(scale) {}
+    Vec3D point;
+    const Interpolator &interpolator;
+    double weight, ref_val, scale;
+};
+
+const int kBlockSize[3] = {((6+1)-3), 3, K_INT};
+
+TEST_F(JacobianTest, ProjectionJacobianMatchesAutoDiff) {
+    const double *params[3] = {q.data(), t.data(), intrinsic.data()};
+    for (const auto &pt : cloud.points) {
+        const Vec3D point(pt.x, pt.y, pt.z);
+        Eigen::Matrix<double, 2, 7 + K_INT> jacobian;
+        const Vec2D uv = projectionJacobian(q.data(), t.data(), intrinsic.data(), point, &jacobian);
+
+        ceres::AutoDiffCostFunction<ProjectionFunctor, 2, ((6+1)-3), 3, K_INT> autodiff(new ProjectionFunctor{point});
+        double uv_auto[2], jac_auto[3][2 * K_INT];
+        double *jac_auto_ptr[3] = {jac_auto[0], jac_auto[1], jac_auto[2]};
+        ASSERT_TRUE(autodiff.Evaluate(params, uv_auto, jac_auto_ptr));
+        EXPECT_NEAR(uv(0), uv_auto[0], 1e-9);
+        EXPECT_NEAR(uv(1), uv_auto[1], 1e-9);
+
+        double norm = 0, diff = 0;
+        for (int b = 0, col = 0; b < 3; col += kBlockSize[b], ++b) {
+            for (int row = 0; row < 2; ++row) {
+                for (int k = 0; k < kBlockSize[b]; ++k) {
+                    norm = std::max(norm, fabs(jac_auto[b][row * kBlockSize[b] + k]));
+                    diff = std::max(diff, fabs(jac_auto[b][row * kBlockSize[b] + k] - jacobian(row, col + k)));
+                }
+            }
+        }
+        EXPECT_LT(diff / norm, kTolerance);
+    }
+}
+
+/** with and without the gradient grid, the batch picks the interpolator the field provides **/
+void checkBatchCost(const KdeField &field, const EdgeCloud &cloud, const double *const *params) {
+    FieldBinding binding;
+    binding.field = &field;
+    binding.weight = 0.5;
+    const int num_points = std::min((int)cloud.size(), BATCH_SIZE);
+    QuaternionBatchCost batch(cloud, 0, num_points, binding);
+    std::vector<double> residuals(num_points), residuals_only(num_points);
+    std::vector<double> jac[3];
+    double *jac_ptr[3];
+    for (int b = 0; b < 3; ++b) {
+        jac[b].resize(num_points * kBlockSize[b]);
+        jac_ptr[b] = jac[b].data();
+    }
+    ASSERT_TRUE(batch.Evaluate(params, residuals.data(), jac_ptr));
+    ASSERT_TRUE(batch.Evaluate(params, residuals_only.data(), nullptr));
+
+    auto check = [&](const auto &interpolator) {
+        typedef std::decay_t<decltype(interpolator)> Interpolator;
+        for (int i = 0; i < num_points; ++i) {
+            const Vec3D point(cloud.points[i].x, cloud.points[i].y, cloud.points[i].z);
+            ceres::AutoDiffCostFunction<RobustFunctor<Interpolator>, 1, ((6+1)-3), 3, K_INT> autodiff(
+                    new RobustFunctor<Interpolator>(point, interpolator, binding.weight, field.refVal, field.scale));
+            double res_auto, jac_auto[3][K_INT];
+            double *jac_auto_ptr[3] = {jac_auto[0], jac_auto[1], jac_auto[2]};
+            ASSERT_TRUE(autodiff.Evaluate(params, &res_auto, jac_auto_ptr));
+            EXPECT_NEAR(residuals[i], res_auto, 1e-9);
+            /** the residual only path projects in its own loop **/
+            EXPECT_NEAR(residuals_only[i], res_auto, 1e-9);
+
+            double norm = 0, diff = 0;
+            for (int b = 0; b < 3; ++b) {
+                for (int k = 0; k < kBlockSize[b]; ++k) {
+                    norm = std::max(norm, fabs(jac_auto[b][k]));
+                    diff = std::max(diff, fabs(jac_auto[b][k] - jac[b][i * kBlockSize[b] + k]));
+                }
+            }
+            EXPECT_LT(diff / std::max(norm, 1e-12), kTolerance) << "point " << i;
+        }
+    };
+    if (field.hasGradient()) {
+        check(field.gradient());
+    }
+    else {
+        check(field.interpolator());
+    }
+}
+
+TEST_F(JacobianTest, BatchCostMatchesAutoDiffBicubic) {
+    const double *params[3] = {q.data(), t.data(), intrinsic.data()};
+    std::unique_ptr<KdeField> field = syntheticField(false);
+    checkBatchCost(*field, cloud, params);
+}
+
+TEST_F(JacobianTest, BatchCostMatchesAutoDiffGradientGrid) {
+    const double *params[3] = {q.data(), t.data(), intrinsic.data()};
+    std::unique_ptr<KdeField> field = syntheticField(true);
+    checkBatchCost(*field, cloud, params);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}